@@ -0,0 +1,358 @@
+/*
+ * motor-bench: load generator for motors-daemon.
+ *
+ * Runs a number of concurrent clients, each on its own connection, sending a
+ * weighted mix of requests and timing every one from the write of its frame
+ * to the read of its reply. At the end it prints throughput and latency
+ * percentiles per command and overall, as text or as one JSON line that can
+ * be kept and compared across daemon builds.
+ *
+ * Results only mean something against a motor that behaves the same every
+ * run, start the daemon on the simulated motor for that:
+ *
+ *   motors-daemon -p -s 2130,1600
+ *   motor-bench -c 8 -n 20000 -m mixed
+ *
+ * Build with: make motor-bench, see the Makefile
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "motor-protocol.h"
+#include "motor-client.h"
+
+#define BENCH_MAX_CLIENTS 256
+#define BENCH_MAX_DEPTH 64
+#define BENCH_KINDS 8
+
+/* one kind of request the mix can pick */
+struct bench_kind
+{
+  const char *name;
+  char command;
+  char type;
+  int weight;
+};
+
+/* what one client thread does and what it measured */
+struct bench_client
+{
+  pthread_t thread;
+  int index;
+  uint32_t seed;
+  int count;                    // requests to send
+  int errors;                   // replies with a status other than MOTOR_OK
+  int failed;                   // the connection broke
+  uint64_t *latency_ns;         // per request, in send order
+  uint8_t *kind;                // index into the mix, in send order
+};
+
+struct bench_kind mix[BENCH_KINDS];
+int nmix = 0;
+int depth = 1;                  // requests in flight per client
+int move_steps = 1;             // size of the relative moves, back and forth
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* xorshift32, the same sequence for the same seed on every run */
+static uint32_t bench_rand(uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static int send_kind(struct motor_client *mc, struct bench_kind *k, int *direction)
+{
+  struct request req;
+
+  motor_request_init(&req, k->command, k->type);
+  if (k->command == 'd') {
+    // moves go back and forth so the motor stays where it started
+    motor_request_move_rel(&req, *direction * move_steps, 0, 0, 0);
+    *direction = -*direction;
+  }
+  if (motor_client_queue(mc, &req, 0, NULL, 0) == 0)
+    return -1;
+  return motor_client_flush(mc);
+}
+
+/*
+ * Keep depth requests in flight: send until the window is full, then read a
+ * reply and send the next. The daemon answers a connection's requests in
+ * order when none of them waits, so the oldest send time is the one a reply
+ * belongs to.
+ */
+static void *bench_run(void *arg)
+{
+  struct bench_client *cl = arg;
+  uint64_t sent_at[BENCH_MAX_DEPTH];
+  int direction = 1, total = 0, next = 0, done = 0, i;
+  struct motor_client mc;
+
+  if (motor_client_open(&mc, 0) == -1) {
+    cl->failed = 1;
+    return NULL;
+  }
+  for (i = 0; i < nmix; i++)
+    total += mix[i].weight;
+
+  while (done < cl->count) {
+    while (next < cl->count && next - done < depth) {
+      int pick = bench_rand(&cl->seed) % total;
+      for (i = 0; pick >= mix[i].weight; i++)
+        pick -= mix[i].weight;
+      cl->kind[next] = i;
+      sent_at[next % depth] = now_ns();
+      if (send_kind(&mc, &mix[i], &direction) != 0) {
+        cl->failed = 1;
+        motor_client_close(&mc);
+        return NULL;
+      }
+      next++;
+    }
+
+    struct motor_frame hdr;
+    if (motor_client_next(&mc, &hdr, NULL, 0) != 1) {
+      cl->failed = 1;
+      break;
+    }
+    cl->latency_ns[done] = now_ns() - sent_at[done % depth];
+    if (hdr.status != MOTOR_OK)
+      cl->errors++;
+    done++;
+  }
+  cl->count = done;
+  motor_client_close(&mc);
+  return NULL;
+}
+
+/* the named mixes, or a custom one as "j=4,p=1,g=2" */
+static int parse_mix(const char *arg)
+{
+  static const struct bench_kind known[] = {
+    { "j", 'j', 0, 0 }, { "p", 'p', 0, 0 }, { "b", 'b', 0, 0 }, { "S", 'S', 0, 0 },
+    { "g", 'd', 'g', 0 }, { "C", 'C', 0, 0 },
+  };
+  const char *spec = arg;
+  char *copy, *tok, *save;
+  size_t i;
+
+  if (strcmp(arg, "status") == 0)
+    spec = "j=1,p=1,b=1,S=1";
+  else if (strcmp(arg, "move") == 0)
+    spec = "g=1";
+  else if (strcmp(arg, "mixed") == 0)
+    spec = "j=3,p=3,b=3,S=1,g=2";
+
+  nmix = 0;
+  copy = strdup(spec);
+  if (copy == NULL)
+    return -1;
+  for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    char *eq = strchr(tok, '=');
+    int weight = eq ? atoi(eq + 1) : 1;
+    if (eq)
+      *eq = '\0';
+    for (i = 0; i < sizeof(known) / sizeof(known[0]) && strcmp(known[i].name, tok) != 0; i++)
+      ;
+    if (i == sizeof(known) / sizeof(known[0]) || weight <= 0 || nmix == BENCH_KINDS) {
+      printf("Invalid mix entry %s\n", tok);
+      free(copy);
+      return -1;
+    }
+    mix[nmix] = known[i];
+    mix[nmix++].weight = weight;
+  }
+  free(copy);
+  return nmix ? 0 : -1;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* nearest rank percentile of sorted values, in microseconds */
+static double percentile_us(const uint64_t *sorted, size_t n, double p)
+{
+  size_t rank;
+
+  if (n == 0)
+    return 0;
+  rank = (size_t) (p / 100.0 * n + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > n)
+    rank = n;
+  return sorted[rank - 1] / 1000.0;
+}
+
+struct bench_result
+{
+  const char *name;
+  size_t count;
+  double p50, p99, p999, max;
+};
+
+static void summarize(struct bench_result *r, const char *name, uint64_t *values, size_t n)
+{
+  qsort(values, n, sizeof(uint64_t), compare_u64);
+  r->name = name;
+  r->count = n;
+  r->p50 = percentile_us(values, n, 50);
+  r->p99 = percentile_us(values, n, 99);
+  r->p999 = percentile_us(values, n, 99.9);
+  r->max = n ? values[n - 1] / 1000.0 : 0;
+}
+
+static void usage(char *progname)
+{
+  printf("Usage : %s\n"
+         "\t -c N concurrent clients, one connection each (default 1)\n"
+         "\t -n N requests per client (default 10000)\n"
+         "\t -m MIX status, move, mixed or weights such as j=4,p=1,g=2 (default status)\n"
+         "\t    j p b S C are status queries and counters, g a relative move\n"
+         "\t -p N requests in flight per client (default 1)\n"
+         "\t -g N steps per relative move, alternating in direction (default 1)\n"
+         "\t -r N random seed of the mix (default 1)\n"
+         "\t -J print one json line instead of the table\n",
+         progname);
+}
+
+int main(int argc, char *argv[])
+{
+  struct bench_client clients[BENCH_MAX_CLIENTS];
+  struct bench_result results[BENCH_KINDS + 1];
+  const char *mix_name = "status";
+  int nclients = 1, count = 10000, errors = 0, failed = 0;
+  uint32_t seed = 1;
+  bool json = false;
+  uint64_t started, elapsed;
+  size_t total = 0, k, n;
+  uint64_t *all, *part;
+  int c, i, j;
+
+  while ((c = getopt(argc, argv, "c:n:m:p:g:r:Jh")) != -1) {
+    switch (c) {
+    case 'c':
+      nclients = atoi(optarg);
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'm':
+      mix_name = optarg;
+      break;
+    case 'p':
+      depth = atoi(optarg);
+      break;
+    case 'g':
+      move_steps = atoi(optarg);
+      break;
+    case 'r':
+      seed = strtoul(optarg, NULL, 0);
+      break;
+    case 'J':
+      json = true;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (nclients < 1 || nclients > BENCH_MAX_CLIENTS || count < 1 || depth < 1 || depth > BENCH_MAX_DEPTH ||
+      seed == 0 || parse_mix(mix_name) != 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < nclients; i++) {
+    clients[i].index = i;
+    clients[i].seed = seed + i * 0x9e3779b9u;
+    if (clients[i].seed == 0)
+      clients[i].seed = 1;
+    clients[i].count = count;
+    clients[i].errors = 0;
+    clients[i].failed = 0;
+    clients[i].latency_ns = calloc(count, sizeof(uint64_t));
+    clients[i].kind = calloc(count, 1);
+    if (clients[i].latency_ns == NULL || clients[i].kind == NULL) {
+      printf("Out of memory\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  started = now_ns();
+  for (i = 0; i < nclients; i++)
+    pthread_create(&clients[i].thread, NULL, bench_run, &clients[i]);
+  for (i = 0; i < nclients; i++)
+    pthread_join(clients[i].thread, NULL);
+  elapsed = now_ns() - started;
+
+  for (i = 0; i < nclients; i++) {
+    total += clients[i].count;
+    errors += clients[i].errors;
+    failed += clients[i].failed;
+  }
+  if (total == 0) {
+    printf("No replies, is the daemon running?\n");
+    return EXIT_FAILURE;
+  }
+
+  all = malloc(total * sizeof(uint64_t));
+  part = malloc(total * sizeof(uint64_t));
+  if (all == NULL || part == NULL) {
+    printf("Out of memory\n");
+    return EXIT_FAILURE;
+  }
+  for (j = 0; j < nmix; j++) {
+    n = 0;
+    for (i = 0; i < nclients; i++)
+      for (k = 0; k < (size_t) clients[i].count; k++)
+        if (clients[i].kind[k] == j)
+          part[n++] = clients[i].latency_ns[k];
+    summarize(&results[j], mix[j].name, part, n);
+  }
+  n = 0;
+  for (i = 0; i < nclients; i++)
+    for (k = 0; k < (size_t) clients[i].count; k++)
+      all[n++] = clients[i].latency_ns[k];
+  summarize(&results[nmix], "all", all, n);
+
+  double seconds = elapsed / 1e9;
+  if (json) {
+    printf("{\"clients\":%d,\"requests\":%d,\"depth\":%d,\"mix\":\"%s\",\"seed\":%u,"
+           "\"seconds\":%.3f,\"rps\":%.0f,\"errors\":%d,\"failed\":%d,\"latency_us\":{",
+           nclients, count, depth, mix_name, seed, seconds, total / seconds, errors, failed);
+    for (j = 0; j <= nmix; j++)
+      printf("%s\"%s\":{\"count\":%zu,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+             j ? "," : "", results[j].name, results[j].count, results[j].p50, results[j].p99,
+             results[j].p999, results[j].max);
+    printf("}}\n");
+  } else {
+    printf("%d clients x %d requests, %d in flight, mix %s, seed %u\n", nclients, count, depth, mix_name, seed);
+    printf("%zu replies in %.3f s, %.0f requests/s, %d errors%s\n", total, seconds, total / seconds, errors,
+           failed ? ", some connections failed" : "");
+    printf("%-6s %10s %10s %10s %10s %10s\n", "cmd", "count", "p50 us", "p99 us", "p999 us", "max us");
+    for (j = 0; j <= nmix; j++)
+      printf("%-6s %10zu %10.1f %10.1f %10.1f %10.1f\n", results[j].name, results[j].count,
+             results[j].p50, results[j].p99, results[j].p999, results[j].max);
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,75 @@
+#ifndef MOTOR_CAPTURE_H
+#define MOTOR_CAPTURE_H
+
+/*
+ * Capture of the requests motors-daemon receives, for motor-replay.
+ *
+ * With -R the daemon appends a record for every request frame it takes off a
+ * client socket, holding the time since the capture started, the connection
+ * it came in on and the frame's id, flags and payload, and one for every
+ * reply it sends with its status. Records for the motor's position come
+ * before the first request and whenever the capture is written out while the
+ * motor runs or after requests, so the last one is where the traffic left
+ * the motor. Records are written in batches, at most CAPTURE_FLUSH_MS apart.
+ *
+ * A capture is a struct motor_capture_header followed by records, each a
+ * struct motor_capture_record and length bytes of payload.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "motor-protocol.h"
+
+#define MOTOR_CAPTURE_MAGIC 0x54504143 // "CAPT"
+#define MOTOR_CAPTURE_VERSION 1
+
+/* record kinds */
+#define MOTOR_CAPTURE_REQUEST 0x1   // payload is the request frame's payload
+#define MOTOR_CAPTURE_REPLY 0x2     // no payload, status is the reply's
+#define MOTOR_CAPTURE_POSITION 0x3  // payload is struct motor_message
+
+struct motor_capture_header
+{
+  uint32_t magic;
+  uint32_t version;
+  int64_t started;              // wall clock seconds the capture started at
+};
+
+struct motor_capture_record
+{
+  uint64_t stamp_us;            // since the capture started
+  uint32_t conn;                // connection, numbered from 1 in the order accepted
+  uint32_t id;                  // frame id
+  uint8_t kind;                 // MOTOR_CAPTURE_*
+  uint8_t status;               // replies, MOTOR_OK or MOTOR_ERR_*
+  uint16_t flags;               // requests, the frame's MOTOR_FLAG_*
+  uint16_t length;              // payload bytes after the record
+  uint16_t reserved;
+};
+
+/*
+ * Next record of a capture, its payload copied into payload as far as size
+ * allows. Returns 1 for a record, 0 at the end and -1 on a cut short one.
+ */
+static inline int motor_capture_read(FILE *f, struct motor_capture_record *rec, void *payload, size_t size)
+{
+  char skip[64];
+  size_t left, n;
+
+  // a record cut short, by a daemon killed while writing, is an error and not the end
+  n = fread(rec, 1, sizeof(*rec), f);
+  if (n != sizeof(*rec))
+    return n == 0 && feof(f) ? 0 : -1;
+  n = rec->length < size ? rec->length : size;
+  if (n != 0 && fread(payload, 1, n, f) != n)
+    return -1;
+  for (left = rec->length - n; left > 0; left -= n) {
+    n = left < sizeof(skip) ? left : sizeof(skip);
+    if (fread(skip, 1, n, f) != n)
+      return -1;
+  }
+  return 1;
+}
+
+#endif
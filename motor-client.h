@@ -0,0 +1,309 @@
+#ifndef MOTOR_CLIENT_H
+#define MOTOR_CLIENT_H
+
+/*
+ * Client side of the motors-daemon protocol, for programs that keep one
+ * connection open instead of running ingenic-motor for every action.
+ *
+ * A struct motor_client is one connection with its own frame buffers. The
+ * typed calls (motor_move_abs(), motor_status(), ...) send one request and
+ * block until its reply is in, which suits a connection nothing else is
+ * outstanding on. For batches and event loops, requests are queued with
+ * motor_client_queue(), go out together with motor_client_flush() and their
+ * replies come back through motor_client_next(), matched up by id. Opened
+ * with MOTOR_CLIENT_NONBLOCK, flush and next never block: they return what
+ * is left to do, and the caller waits on the fd for POLLOUT or POLLIN.
+ *
+ * Every call returns -1 once the connection is gone or the daemon does not
+ * speak the protocol, the connection is of no further use then.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "motor-protocol.h"
+
+#define MOTOR_CLIENT_BUF_SIZE 8192  // fits the largest reply, a metrics answer
+#define MOTOR_CLIENT_NONBLOCK 0x1
+
+struct motor_client
+{
+  int fd;
+  bool nonblock;
+  uint32_t next_id;
+  size_t inlen;
+  size_t outlen;
+  size_t outpos;
+  unsigned char in[MOTOR_CLIENT_BUF_SIZE];
+  unsigned char out[MOTOR_CLIENT_BUF_SIZE];
+};
+
+static inline int motor_client_open(struct motor_client *mc, int flags)
+{
+  struct sockaddr_un addr;
+
+  memset(mc, 0, sizeof(*mc));
+  mc->next_id = 1;
+  mc->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (mc->fd == -1)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, SV_SOCK_PATH, sizeof(addr.sun_path) - 1);
+  if (connect(mc->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    close(mc->fd);
+    mc->fd = -1;
+    return -1;
+  }
+  if (flags & MOTOR_CLIENT_NONBLOCK) {
+    fcntl(mc->fd, F_SETFL, fcntl(mc->fd, F_GETFL, 0) | O_NONBLOCK);
+    mc->nonblock = true;
+  }
+  return 0;
+}
+
+static inline void motor_client_close(struct motor_client *mc)
+{
+  if (mc->fd != -1)
+    close(mc->fd);
+  mc->fd = -1;
+}
+
+/* queue a frame with the payload as given, for replaying captured traffic */
+static inline int motor_client_queue_frame(struct motor_client *mc, uint32_t id, uint16_t flags,
+                                           const void *payload, size_t len)
+{
+  struct motor_frame hdr;
+
+  if (len > MOTOR_MAX_PAYLOAD || mc->outlen + sizeof(hdr) + len > sizeof(mc->out))
+    return -1;
+  motor_frame_init(&hdr, MOTOR_FRAME_REQUEST, id, len);
+  hdr.flags = flags;
+  memcpy(mc->out + mc->outlen, &hdr, sizeof(hdr));
+  if (len != 0)
+    memcpy(mc->out + mc->outlen + sizeof(hdr), payload, len);
+  mc->outlen += sizeof(hdr) + len;
+  return 0;
+}
+
+/*
+ * Queue a request, followed by len bytes of command specific data, with
+ * MOTOR_FLAG_* flags. Returns the id its reply will carry, 0 when the
+ * batch is full and has to be flushed first.
+ */
+static inline uint32_t motor_client_queue(struct motor_client *mc, const struct request *req, uint16_t flags,
+                                          const void *data, size_t len)
+{
+  unsigned char payload[MOTOR_MAX_PAYLOAD];
+  uint32_t id = mc->next_id;
+
+  if (sizeof(*req) + len > sizeof(payload))
+    return 0;
+  memcpy(payload, req, sizeof(*req));
+  if (len != 0)
+    memcpy(payload + sizeof(*req), data, len);
+  if (motor_client_queue_frame(mc, id, flags, payload, sizeof(*req) + len) == -1)
+    return 0;
+  if (++mc->next_id == 0)
+    mc->next_id = 1;
+  return id;
+}
+
+/* send what is queued, returns 0 once all of it is out and 1 while some is left */
+static inline int motor_client_flush(struct motor_client *mc)
+{
+  while (mc->outpos < mc->outlen) {
+    ssize_t n = send(mc->fd, mc->out + mc->outpos, mc->outlen - mc->outpos, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+      return -1;
+    }
+    mc->outpos += n;
+  }
+  mc->outpos = 0;
+  mc->outlen = 0;
+  return 0;
+}
+
+/*
+ * Next reply or event frame. The payload is copied into buf as far as size
+ * allows and the rest of buf is cleared. Returns 1 for a frame, 0 when a
+ * non-blocking connection has no whole frame yet.
+ */
+static inline int motor_client_next(struct motor_client *mc, struct motor_frame *hdr, void *buf, size_t size)
+{
+  for (;;) {
+    if (mc->inlen >= sizeof(*hdr)) {
+      size_t total, n;
+      memcpy(hdr, mc->in, sizeof(*hdr));
+      if (hdr->magic != MOTOR_PROTO_MAGIC || hdr->version != MOTOR_PROTO_VERSION ||
+          sizeof(*hdr) + hdr->length > sizeof(mc->in))
+        return -1;
+      total = sizeof(*hdr) + hdr->length;
+      if (mc->inlen >= total) {
+        n = hdr->length < size ? hdr->length : size;
+        if (size != 0) {
+          memset(buf, 0, size);
+          memcpy(buf, mc->in + sizeof(*hdr), n);
+        }
+        mc->inlen -= total;
+        memmove(mc->in, mc->in + total, mc->inlen);
+        return 1;
+      }
+    }
+
+    ssize_t n = read(mc->fd, mc->in + mc->inlen, sizeof(mc->in) - mc->inlen);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+    if (n == 0)
+      return -1;
+    mc->inlen += n;
+  }
+}
+
+/*
+ * Send one request and wait for its reply, on a connection that has nothing
+ * else outstanding: replies to other ids and events are dropped. Returns the
+ * reply status, MOTOR_OK or MOTOR_ERR_*.
+ */
+static inline int motor_client_call(struct motor_client *mc, const struct request *req, uint16_t flags,
+                                    const void *data, size_t len, void *reply, size_t size)
+{
+  struct pollfd pfd = { .fd = mc->fd };
+  struct motor_frame hdr;
+  uint32_t id = motor_client_queue(mc, req, flags, data, len);
+  int ret;
+
+  if (id == 0)
+    return -1;
+  while ((ret = motor_client_flush(mc)) == 1) {
+    pfd.events = POLLOUT;
+    poll(&pfd, 1, -1);
+  }
+  if (ret == -1)
+    return -1;
+  for (;;) {
+    ret = motor_client_next(mc, &hdr, reply, size);
+    if (ret == -1)
+      return -1;
+    if (ret == 0) {
+      pfd.events = POLLIN;
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    if (hdr.kind == MOTOR_FRAME_REPLY && hdr.id == id)
+      return hdr.status;
+  }
+}
+
+/* requests for the typed calls, also for queueing them in a batch */
+static inline void motor_request_init(struct request *req, char command, char type)
+{
+  memset(req, 0, sizeof(*req));
+  req->command = command;
+  req->type = type;
+}
+
+/* go to x, y in driver coordinates; speed 0 keeps the last one, wait_ms > 0 replies once it is there */
+static inline void motor_request_move_abs(struct request *req, int x, int y, int speed, int wait_ms)
+{
+  motor_request_init(req, 'd', 'h');
+  req->x = x;
+  req->y = y;
+  req->got_x = 1;
+  req->got_y = 1;
+  req->speed = speed;
+  req->wait = wait_ms;
+}
+
+static inline void motor_request_move_rel(struct request *req, int dx, int dy, int speed, int wait_ms)
+{
+  motor_request_move_abs(req, dx, dy, speed, wait_ms);
+  req->type = 'g';
+}
+
+/*
+ * The typed calls. status may be NULL for those that do not need it, where
+ * given it is filled in from the reply to status queries and waits.
+ */
+static inline int motor_move_abs(struct motor_client *mc, int x, int y, int speed, int wait_ms,
+                                 struct motor_status_reply *status)
+{
+  struct motor_status_reply ignored;
+  struct request req;
+
+  motor_request_move_abs(&req, x, y, speed, wait_ms);
+  return motor_client_call(mc, &req, 0, NULL, 0, status ? status : &ignored, sizeof(ignored));
+}
+
+static inline int motor_move_rel(struct motor_client *mc, int dx, int dy, int speed, int wait_ms,
+                                 struct motor_status_reply *status)
+{
+  struct motor_status_reply ignored;
+  struct request req;
+
+  motor_request_move_rel(&req, dx, dy, speed, wait_ms);
+  return motor_client_call(mc, &req, 0, NULL, 0, status ? status : &ignored, sizeof(ignored));
+}
+
+static inline int motor_stop(struct motor_client *mc)
+{
+  struct request req;
+
+  motor_request_init(&req, 'd', 's');
+  return motor_client_call(mc, &req, 0, NULL, 0, NULL, 0);
+}
+
+static inline int motor_status(struct motor_client *mc, struct motor_status_reply *status)
+{
+  struct request req;
+
+  motor_request_init(&req, 'e', 0);
+  return motor_client_call(mc, &req, 0, NULL, 0, status, sizeof(*status));
+}
+
+/* MOTOR_ERR_TIMEOUT when the motor is still busy after timeout_ms */
+static inline int motor_wait_idle(struct motor_client *mc, int timeout_ms, struct motor_status_reply *status)
+{
+  struct motor_status_reply ignored;
+  struct request req;
+
+  motor_request_init(&req, 'w', 0);
+  req.wait = timeout_ms;
+  return motor_client_call(mc, &req, 0, NULL, 0, status ? status : &ignored, sizeof(ignored));
+}
+
+static inline int motor_set_speed(struct motor_client *mc, int speed)
+{
+  struct request req;
+
+  motor_request_init(&req, 's', 0);
+  req.speed = speed;
+  return motor_client_call(mc, &req, 0, NULL, 0, NULL, 0);
+}
+
+/* axis 'x', 'y' or 'b' for both */
+static inline int motor_invert(struct motor_client *mc, char axis)
+{
+  struct request req;
+
+  motor_request_init(&req, 'I', axis);
+  return motor_client_call(mc, &req, 0, NULL, 0, NULL, 0);
+}
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,10 +13,52 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <stdbool.h>
-
-#define SV_SOCK_PATH "/dev/md"
-#define MAX_CONN 5
+#include <stdint.h>
+#include <time.h>
+
+#include "motor-shm.h"
+#include "motor-planner.h"
+#include "motor-protocol.h"
+#include "motor-journal.h"
+#include "motor-sim.h"
+#include "motor-trace.h"
+#include "motor-capture.h"
+
+#define MAX_CONN 32
+#define MAX_CLIENTS 64
+#define MAX_EVENTS 16
+#define CLIENT_IN_SIZE (2 * (sizeof(struct motor_frame) + MOTOR_MAX_PAYLOAD))
+#define CLIENT_OUT_SIZE 8192
+#define MAX_METRICS_SIZE (sizeof(struct motor_metrics) + MOTOR_METRICS_MAX_COMMANDS * sizeof(struct motor_command_metrics))
+#define MAX_REPLY_SIZE (sizeof(struct motor_frame) + MAX_METRICS_SIZE)
+#define CLIENT_TIMEOUT_MS 5000          // stalled partial request or unread reply
+#define CLIENT_IDLE_TIMEOUT_MS 300000   // idle persistent session
+#define STATUS_TIMER_MIN_MS 10
+#define PLAN_POLL_MS 5   // status poll interval once a segment is due to end
+#define COALESCE_MS 50   // default control tick, at most one new move per tick
+#define VELOCITY_SEGMENT_MS 100  // length of each piece of continuous motion
+#define DEADMAN_MS 500   // default, velocity mode stops without a refresh this long
+#define TRACK_DEADBAND 8 // default, steps the filtered target may drift before the motor follows
+#define TRACK_GAP_MS 1000 // a target after a gap this long starts tracking afresh
+#define TRACK_MIN_DT_MS 10 // shortest time between targets the filter assumes
+#define WAIT_DEFAULT_MS 60000  // 'w' without a timeout
+#define RESET_WAIT_MS 600000   // longest a reset reply is held back for the homing sweep
+#define COMMAND_QUEUE_SIZE 64  // power of two
+#define PRESET_PATH "/etc/motors-presets"
+#define PRESET_MAGIC 0x54535250 // "PRST"
+#define PRESET_VERSION 1
+#define PRESET_HASH_SIZE 64    // power of two, twice MOTOR_MAX_PRESETS
+#define ROUTE_MAX_POINTS 256
+#define METRICS_COMMANDS "drspbSijeCMwuPTIX" // plus a slot for unknown commands
+#define TRACE_RECORDS 4096     // power of two, 128 KB of trace
+#define CAPTURE_BUF_SIZE 16384 // request capture records written out at once
+#define CAPTURE_FLUSH_MS 1000  // longest a capture record waits to be written
 #define MOTOR_MOVE_STOP 0x0
 #define MOTOR_MOVE_RUN 0x1
 
@@ -39,12 +82,6 @@
 
 #define PID_SIZE 32
 
-enum motor_status
-{
-  MOTOR_IS_STOP,
-  MOTOR_IS_RUNNING,
-};
-
 enum motor_inversion {
     MOTOR_NO_INVERSION = 0x0,      // No inversion
     MOTOR_INVERT_X = 0x1,          // Invert X only
@@ -54,16 +91,6 @@ enum motor_inversion {
 
 enum motor_inversion motor_inversion_state = MOTOR_NO_INVERSION;  // Default is no inversion
 
-struct request{
-    char command; // d,r,s,p,b,S,i,j (move, reset,set speed,get position, is busy,Status,initial,JSON)
-    char type;   // g,h,c,s (absolute,relative,cruise,stop)
-    int x;
-    int got_x;
-    int y;
-    int got_y;
-    int speed;  // Add speed to the request structure
-};
-
 struct motor_status_st
 {
   int directional_attr;
@@ -76,208 +103,2879 @@ struct motor_status_st
   int move_is_max;
 };
 
-struct motor_message
+struct motors_steps
 {
   int x;
   int y;
-  enum motor_status status;
-  int speed;
-  /* these two members are not standard from the original kernel module */
+};
+
+struct motor_reset_data
+{
   unsigned int x_max_steps;
   unsigned int y_max_steps;
-  unsigned int inversion_state; // Report the inversion state
+  unsigned int x_cur_step;
+  unsigned int y_cur_step;
 };
 
-struct motors_steps
+/*
+ * What motor_ioctl() drives: the kernel module, or the simulator from
+ * motor-sim.h so the daemon can run and be measured without the hardware.
+ * Both take the driver's ioctl commands and argument layouts.
+ */
+struct motor_backend
+{
+  const char *name;
+  int (*open)(void);
+  int (*ioctl)(int cmd, void *arg);
+};
+
+/*
+ * Last MOTOR_GET_STATUS result. Only this daemon moves the motor, so while it
+ * is stopped the snapshot stays exact until the next ioctl that acts on the
+ * motor; while it runs the snapshot is refreshed every status_refresh_ms.
+ */
+struct status_cache
+{
+  struct motor_message msg;
+  bool valid;
+  long long stamp;          // monotonic ms of the last MOTOR_GET_STATUS
+  unsigned int ioctls;      // MOTOR_GET_STATUS calls made
+  unsigned int hits;        // status lookups answered without an ioctl
+};
+
+/*
+ * Continuous motion at a requested rate. The daemon keeps streaming short
+ * pieces to the driver for as long as the client refreshes the velocity;
+ * without a refresh for velocity_deadman_ms the motor is left to stop.
+ */
+struct velocity
+{
+  bool active;
+  int vx;                   // steps/s, driver directions
+  int vy;
+  long long refreshed;      // monotonic ms of the last velocity request
+};
+
+/*
+ * Target tracking. Targets come in at the detector's rate with its noise, an
+ * alpha-beta filter turns them into a position and rate per axis. The motor
+ * is sent to the filtered target, led by one control tick, only when that is
+ * further than the deadband from where it was last sent, and no faster than
+ * the slew limit. Moves go through move_queue() like any other.
+ */
+struct tracker
+{
+  bool active;
+  double x;                 // filtered target, driver coordinates
+  double y;
+  double vx;                // filtered rate, steps/s
+  double vy;
+  long long updated;        // monotonic ms of the last target
+  int sent_x;               // last target handed to move_queue()
+  int sent_y;
+  long long sent_at;
+};
+
+/*
+ * Move requests are not handed to the driver one by one. Each one only
+ * updates the pending target, in driver coordinates: relative steps add up
+ * and an absolute position replaces whatever was pending. The pending target
+ * is turned into a single move at most once per control tick.
+ */
+struct move_request
+{
+  bool pending;
+  int x;
+  int y;
+  int speed;
+  unsigned int count;       // requests folded into this target
+};
+
+/* a request handed to the control thread, speed already resolved */
+struct motor_command
+{
+  uint32_t seq;             // order of the request, shared with stops
+  struct request req;
+};
+
+/*
+ * Commands from the I/O thread to the control thread. Only the I/O thread
+ * moves head and only the control thread moves tail, so neither side ever
+ * takes a lock or waits for the other.
+ */
+struct command_queue
+{
+  atomic_uint head;         // next slot the I/O thread fills
+  atomic_uint tail;         // next slot the control thread takes
+  struct motor_command slots[COMMAND_QUEUE_SIZE];
+};
+
+/* daemon state as the I/O thread sees it */
+struct daemon_view
+{
+  struct motor_message msg; // last status read, inversion_state filled in
+  bool busy;                // queued, planned, running or in a blocking ioctl
+  bool homing;              // the control thread is in a reset sweep
+  uint32_t done;            // last command seq the control thread is done with
+  struct motor_motion motion; // to estimate the position between status reads
+  struct daemon_counters counters;
+};
+
+/*
+ * Published by the control thread after every round and before any ioctl
+ * that may block, read by the I/O thread without a lock the same way as the
+ * status page: seq is odd while an update is in progress.
+ */
+struct daemon_snapshot
+{
+  atomic_uint seq;
+  struct daemon_view view;
+};
+
+/*
+ * Named positions, owned by the I/O thread. Presets live in slot id - 1 and
+ * names are found through a small open addressing hash, so a goto never
+ * scans the table.
+ */
+struct preset_table
+{
+  struct motor_preset slot[MOTOR_MAX_PRESETS]; // id 0 = free
+  int8_t by_name[PRESET_HASH_SIZE];            // slot + 1, 0 = empty
+};
+
+/* preset file: this header, then count used slots */
+struct preset_file
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+};
+
+/* one point of a route, a preset is looked up again each time it is reached */
+struct route_point
 {
   int x;
   int y;
+  int preset;               // slot + 1, 0 = go to x, y
+  int speed;                // 0 = last_known_speed
+  int dwell_ms;
+};
+
+/*
+ * A route the I/O thread walks through: move to a point, wait for the
+ * control thread to be done with the move and the motor to be idle, dwell,
+ * then on to the next point. It is driven by the snapshot and route_timerfd
+ * like waiters are, so a tour or scan needs no client to stay connected.
+ * Subscribers hear about every point reached.
+ */
+struct route
+{
+  int state;                // MOTOR_ROUTE_*
+  char kind;                // 't' tour, 'g' grid scan
+  bool loop;
+  int len;
+  int pos;                  // point moved to or dwelt at
+  uint32_t move_seq;        // command that moves to points[pos]
+  struct route_point points[ROUTE_MAX_POINTS];
+};
+
+_Static_assert(sizeof(struct request) + MOTOR_MAX_WAYPOINTS * sizeof(struct motor_waypoint) <= MOTOR_MAX_PAYLOAD,
+               "a full tour must fit in one request");
+/*
+ * Metrics kept by the I/O thread. Commands are counted by their position in
+ * METRICS_COMMANDS, anything else in the slot after the last.
+ */
+struct daemon_metrics
+{
+  struct motor_histogram commands[sizeof(METRICS_COMMANDS)];
+  struct motor_histogram socket_read;
+  struct motor_histogram socket_write;
+  uint32_t accepted;
+  uint32_t connections_peak;
+  uint32_t queue_peak;
+};
+
+/* time spent in each driver ioctl, kept by the control thread and seqlocked like the snapshot */
+struct ioctl_metrics
+{
+  atomic_uint seq;
+  struct motor_histogram by_cmd[MOTOR_METRICS_IOCTLS];
+};
+
+_Static_assert(MAX_METRICS_SIZE >= MOTOR_MAX_PRESETS * sizeof(struct motor_preset),
+               "the largest reply must be a metrics or preset list");
+_Static_assert(sizeof(METRICS_COMMANDS) <= MOTOR_METRICS_MAX_COMMANDS, "too many metrics commands");
+_Static_assert(CLIENT_OUT_SIZE >= 2 * MAX_REPLY_SIZE, "a client must fit the largest reply and a status update");
+_Static_assert((PRESET_HASH_SIZE & (PRESET_HASH_SIZE - 1)) == 0 && PRESET_HASH_SIZE > MOTOR_MAX_PRESETS,
+               "preset hash size must be a power of two above MOTOR_MAX_PRESETS");
+_Static_assert((COMMAND_QUEUE_SIZE & (COMMAND_QUEUE_SIZE - 1)) == 0,
+               "command queue size must be a power of two");
+_Static_assert(sizeof(struct motor_shm_status) == sizeof(struct motor_message),
+               "status page layout must match struct motor_message");
+
+struct client
+{
+  int fd;
+  uint32_t serial;          // connections accepted before this one + 1, numbers it in the capture
+  uint32_t events;          // epoll events currently watched
+  long long last_active;    // monotonic ms of the last successful read/write
+  bool eof;                 // peer shut down its side, close once drained
+  bool waiting;             // parked until the motor is idle, later requests wait too
+  uint32_t wait_id;         // request the idle reply answers
+  uint32_t wait_seq;        // command that has to be done before the reply
+  bool wait_idle;           // and the motor has to be idle too
+  long long wait_deadline;  // monotonic ms to give up waiting and reply anyway
+  bool subscribed;          // gets status pushed without asking
+  uint32_t sub_id;          // subscribe request, carried by every pushed update
+  int sub_interval_ms;      // push period, 0 = only when the status changes
+  long long sub_next;       // monotonic ms of the next periodic push
+  struct motor_message sub_last; // last status pushed
+  size_t inlen;
+  unsigned char inbuf[CLIENT_IN_SIZE];
+  size_t outlen;
+  size_t outpos;
+  unsigned char outbuf[CLIENT_OUT_SIZE];
 };
 
-struct motor_reset_data
+/* owned by the control thread */
+int motorfd = -1;
+struct motor_sim motor_sim;
+const struct motor_backend *backend;
+struct status_cache status_cache;
+int status_refresh_ms = 100; // status cache lifetime while the motor is running
+struct motor_shm *status_shm = NULL; // published status page, NULL if unavailable
+char *journal_path = MOTOR_JOURNAL_PATH;
+struct motor_journal *journal = NULL; // position journal, NULL if unavailable
+struct motor_journal_record journal_last; // what was last written to it
+struct motor_motion motion;  // how the motor moves since the last status read or piece start
+int status_timerfd = -1;     // re-reads status while the motor runs
+bool status_timer_armed = false;
+struct planner_config planner_config = { {0, 0}, {0, 0}, 100, 0 };
+struct motor_segment plan[PLANNER_MAX_SEGMENTS]; // current move, in driver directions
+int plan_len = 0;
+int plan_pos = 0;            // segment being handed to the driver
+int plan_done = 0;           // major steps of plan[plan_pos] already issued
+int plan_speed = 0;          // requested cruise speed of the current move
+int driver_speed = -1;       // last MOTOR_SPEED sent, -1 if unknown
+int plan_end_x = 0;          // driver position once the current plan completes
+int plan_end_y = 0;
+bool piece_running = false;  // a piece was handed to the driver and not seen finished yet
+long long piece_started = 0; // when the running piece was handed to the driver
+int piece_ms = 0;            // and how long it should take
+struct velocity velocity;
+int velocity_deadman_ms = DEADMAN_MS;
+struct tracker tracker;
+double track_alpha = 0.5;    // filter gain on the position
+double track_beta = 0.1;     // filter gain on the rate
+int track_deadband = TRACK_DEADBAND;
+int track_slew = 0;          // steps/s the sent target may move at, 0 = no limit
+unsigned int targets_received = 0;
+unsigned int target_moves = 0;
+int control_timerfd = -1;    // fires when the running segment should be done
+struct move_request move_request;
+int coalesce_ms = COALESCE_MS;
+long long move_last_flush = -COALESCE_MS;
+int flush_timerfd = -1;      // fires when a pending move may be handed over
+unsigned int moves_received = 0;
+unsigned int moves_merged = 0;
+int control_epollfd = -1;
+uint32_t command_done = 0;   // last command seq handled
+uint32_t stop_handled = 0;   // last stop seq handled
+bool homing = false;         // inside MOTOR_RESET, which only returns once the sweep is done
+long long started_ms = 0;    // monotonic ms the daemon started at
+unsigned int ready_ms = 0;   // startup time until connections were accepted
+unsigned int homed_ms = 0;   // startup time until the first sweep was done
+
+/* shared between the two threads */
+struct command_queue command_queue;
+atomic_uint stop_seq;        // seq of the latest stop, it jumps the queue
+int command_eventfd = -1;    // wakes the control thread
+int status_eventfd = -1;     // wakes the I/O thread after a snapshot
+struct daemon_snapshot snapshot;
+struct ioctl_metrics ioctl_metrics;
+struct motor_trace_record trace_ring[TRACE_RECORDS];
+atomic_uint trace_head;        // records written since start
+atomic_uint trace_mask = MOTOR_TRACE_ALL;
+char *trace_path = MOTOR_TRACE_PATH;
+uint64_t trace_started_us;
+
+/* owned by the I/O thread */
+int epollfd = -1;
+struct client clients[MAX_CLIENTS];
+int nclients = 0;
+int nwaiters = 0;
+int nsubscribers = 0;
+uint32_t command_seq = 0;    // seq of the last command or stop sent
+uint32_t reset_seq = 0;      // seq of the last reset sent
+struct preset_table presets;
+char *preset_path = PRESET_PATH;
+struct route route;
+int route_timerfd = -1;      // ends the dwell at a route point
+unsigned int status_hits = 0; // status queries answered from the snapshot
+struct daemon_metrics metrics;
+uint32_t clients_accepted = 0;
+char *capture_path = NULL;   // request capture for motor-replay, NULL = off
+int capture_fd = -1;
+unsigned char capture_buf[CAPTURE_BUF_SIZE];
+size_t capture_len = 0;
+long long capture_due = 0;   // monotonic ms the capture is written out at
+bool capture_moving = false; // last position captured was not stopped, keep capturing it
+bool capture_positioned = false; // the position before the first request is captured
+uint64_t capture_started_us;
+int last_known_speed = 900; // Default speed
+bool motor_inverted = false; // Global flag for motor inversion
+
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* count one latency in its power of two bucket */
+static void histogram_add(struct motor_histogram *h, uint64_t us)
+{
+    int b = 0;
+
+    while (b < MOTOR_HIST_BUCKETS - 1 && us >= (1ull << b))
+        b++;
+    h->bucket[b]++;
+    h->count++;
+    h->sum_us += us;
+    if (us > h->max_us)
+        h->max_us = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+/*
+ * Trace points, left out at compile time unless their category is in
+ * MOTOR_TRACE_COMPILED and skipped at run time unless it is in trace_mask.
+ * Both threads write, each record is marked complete once filled in.
+ */
+#define TRACE(event, a, b, c, d) \
+    do { \
+        if ((MOTOR_TRACE_COMPILED & MOTOR_TRACE_BIT(event)) && \
+            (atomic_load_explicit(&trace_mask, memory_order_relaxed) & MOTOR_TRACE_BIT(event))) \
+            trace_write(event, a, b, c, d); \
+    } while (0)
+
+static void trace_write(uint16_t event, int32_t a, int32_t b, int32_t c, int32_t d)
+{
+    unsigned int n = atomic_fetch_add_explicit(&trace_head, 1, memory_order_relaxed);
+    struct motor_trace_record *r = &trace_ring[n & (TRACE_RECORDS - 1)];
+
+    atomic_store_explicit(&r->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    r->event = event;
+    r->stamp_us = now_us();
+    r->arg[0] = a;
+    r->arg[1] = b;
+    r->arg[2] = c;
+    r->arg[3] = d;
+    atomic_store_explicit(&r->seq, n + 1, memory_order_release);
+}
+
+/*
+ * Write the ring to trace_path. Only async-signal-safe calls, it also runs
+ * from the crash handler; records being written meanwhile go out marked
+ * incomplete and the decoder skips them.
+ */
+static int trace_dump(int sig)
+{
+    struct motor_trace_header hdr;
+    const char *p = (const char *) trace_ring;
+    size_t left = sizeof(trace_ring);
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+        return -1;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = MOTOR_TRACE_MAGIC;
+    hdr.version = MOTOR_TRACE_VERSION;
+    hdr.record_size = sizeof(struct motor_trace_record);
+    hdr.records = TRACE_RECORDS;
+    hdr.written = atomic_load_explicit(&trace_head, memory_order_acquire);
+    hdr.mask = atomic_load_explicit(&trace_mask, memory_order_relaxed);
+    hdr.started_us = trace_started_us;
+    hdr.pid = getpid();
+    hdr.signal = sig;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        close(fd);
+        return -1;
+    }
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        p += n;
+        left -= n;
+    }
+    return close(fd);
+}
+
+static void trace_signal(int sig)
+{
+    int saved = errno;
+    trace_dump(sig);
+    errno = saved;
+}
+
+/* dump and die the way the signal would have killed the daemon, the handler is reset by now */
+static void trace_crash(int sig)
+{
+    trace_dump(sig);
+    raise(sig);
+}
+
+static void trace_handlers()
+{
+    static const int crashes[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+    struct sigaction sa;
+    size_t i;
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = trace_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = trace_crash;
+    sa.sa_flags = SA_RESETHAND;
+    for (i = 0; i < sizeof(crashes) / sizeof(crashes[0]); i++)
+        sigaction(crashes[i], &sa, NULL);
+}
+
+/* time since the system booted, for boot to ready figures */
+static long long boot_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* seq a was handed out before seq b, wrap safe */
+static bool seq_before(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+/* I/O thread side, false when the control thread is that far behind */
+static bool command_push(const struct motor_command *cmd)
+{
+    unsigned int head = atomic_load_explicit(&command_queue.head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&command_queue.tail, memory_order_acquire);
+
+    if (head - tail == COMMAND_QUEUE_SIZE)
+        return false;
+    command_queue.slots[head & (COMMAND_QUEUE_SIZE - 1)] = *cmd;
+    atomic_store_explicit(&command_queue.head, head + 1, memory_order_release);
+    return true;
+}
+
+/* control thread side, false once the queue is empty */
+static bool command_pop(struct motor_command *cmd)
+{
+    unsigned int tail = atomic_load_explicit(&command_queue.tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&command_queue.head, memory_order_acquire);
+
+    if (tail == head)
+        return false;
+    *cmd = command_queue.slots[tail & (COMMAND_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&command_queue.tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static void eventfd_signal(int fd)
+{
+    uint64_t one = 1;
+    if (fd != -1 && write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        syslog(LOG_DEBUG, "eventfd write failed, errno : %i", errno);
+}
+
+static void eventfd_clear(int fd)
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        syslog(LOG_DEBUG, "eventfd read failed, errno : %i", errno);
+}
+
+/* I/O thread side, a consistent copy of the last snapshot */
+static void snapshot_read(struct daemon_view *view)
+{
+    for (;;) {
+        unsigned int seq = atomic_load_explicit(&snapshot.seq, memory_order_acquire);
+        if (seq & 1)
+            continue;
+        memcpy(view, &snapshot.view, sizeof(struct daemon_view));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&snapshot.seq, memory_order_relaxed) == seq)
+            return;
+    }
+}
+
+/* keep re-reading status every status_refresh_ms until the motor is seen stopped */
+void status_timer_arm(bool on)
+{
+  struct itimerspec its;
+  int ms = status_refresh_ms < STATUS_TIMER_MIN_MS ? STATUS_TIMER_MIN_MS : status_refresh_ms;
+
+  if (status_timerfd == -1 || status_timer_armed == on)
+    return;
+  memset(&its, 0, sizeof(its));
+  if (on) {
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    its.it_interval = its.it_value;
+  }
+  timerfd_settime(status_timerfd, 0, &its, NULL);
+  status_timer_armed = on;
+}
+
+void status_publish(struct motor_message *msg, bool stale)
+{
+  if (status_shm == NULL)
+    return;
+  motor_shm_write_begin(status_shm);
+  if (msg) {
+    memcpy(&status_shm->status, msg, sizeof(struct motor_shm_status));
+    status_shm->status.inversion_state = motor_inversion_state;
+    status_shm->stamp_ms = status_cache.stamp;
+  }
+  status_shm->motion = motion;
+  status_shm->stale = stale;
+  motor_shm_write_end(status_shm);
+}
+
+/* I/O thread: command seq is queued, the page is not current until it is done */
+void status_queued(uint32_t seq)
+{
+  if (status_shm)
+    atomic_store_explicit(&status_shm->queued, seq, memory_order_release);
+}
+
+/* control thread: whatever the commands up to command_done changed is published */
+void status_done()
+{
+  if (status_shm)
+    atomic_store_explicit(&status_shm->done, command_done, memory_order_release);
+}
+
+void status_shm_setup()
+{
+  int fd = open(MOTOR_SHM_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    syslog(LOG_INFO, "Could not create %s, status page disabled", MOTOR_SHM_PATH);
+    return;
+  }
+  if (ftruncate(fd, sizeof(struct motor_shm)) == -1) {
+    close(fd);
+    return;
+  }
+  void *p = mmap(NULL, sizeof(struct motor_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return;
+
+  status_shm = p;
+  memset(status_shm, 0, sizeof(struct motor_shm));
+  status_shm->pid = getpid();
+  status_shm->version = MOTOR_SHM_VERSION;
+  status_shm->stale = 1;
+  atomic_thread_fence(memory_order_release);
+  status_shm->magic = MOTOR_SHM_MAGIC;
+}
+
+void journal_setup()
+{
+  struct stat st;
+  int fd = open(journal_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    syslog(LOG_INFO, "Could not open %s, position journal disabled", journal_path);
+    return;
+  }
+  if (fstat(fd, &st) == -1 ||
+      (st.st_size < (off_t) sizeof(struct motor_journal) && ftruncate(fd, sizeof(struct motor_journal)) == -1)) {
+    close(fd);
+    return;
+  }
+  void *p = mmap(NULL, sizeof(struct motor_journal), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return;
+  journal = p;
+}
+
+/*
+ * Record the motor state, only when it differs from what was last written.
+ * With moving set the recorded position is not to be trusted until a later
+ * update records the motor stopped again.
+ */
+void journal_update(bool moving)
+{
+  struct motor_journal_record rec;
+
+  if (journal == NULL)
+    return;
+  memset(&rec, 0, sizeof(rec));
+  rec.moving = moving;
+  rec.x = status_cache.msg.x;
+  rec.y = status_cache.msg.y;
+  rec.target_x = moving ? plan_end_x : status_cache.msg.x;
+  rec.target_y = moving ? plan_end_y : status_cache.msg.y;
+  rec.x_max_steps = status_cache.msg.x_max_steps;
+  rec.y_max_steps = status_cache.msg.y_max_steps;
+  rec.inversion_state = motor_inversion_state;
+  if (motor_journal_same(&rec, &journal_last))
+    return;
+  motor_journal_write(journal, &rec);
+  journal_last = rec;
+}
+
+static int kernel_open()
+{
+  motorfd = open("/dev/motor", 0);
+  return motorfd;
+}
+
+static int kernel_ioctl(int cmd, void *arg)
+{
+  return ioctl(motorfd, cmd, arg);
+}
+
+static int sim_open()
+{
+  syslog(LOG_INFO, "Simulating a motor of %d x %d steps", motor_sim.x_max, motor_sim.y_max);
+  return 0;
+}
+
+static int sim_ioctl(int cmd, void *arg)
+{
+  struct motor_reset_data *reset = arg;
+  struct motors_steps *steps = arg;
+  struct motor_message *msg = arg;
+  bool running;
+
+  switch (cmd) {
+  case MOTOR_STOP:
+    motor_sim_stop(&motor_sim);
+    break;
+  case MOTOR_RESET:
+    motor_sim_reset(&motor_sim, reset->x_max_steps, reset->y_max_steps, reset->x_cur_step, reset->y_cur_step);
+    reset->x_max_steps = motor_sim.x_max;
+    reset->y_max_steps = motor_sim.y_max;
+    break;
+  case MOTOR_MOVE:
+    motor_sim_move(&motor_sim, steps->x, steps->y);
+    break;
+  case MOTOR_GET_STATUS:
+    running = motor_sim_position(&motor_sim, motor_sim_now(), &msg->x, &msg->y);
+    msg->status = running ? MOTOR_IS_RUNNING : MOTOR_IS_STOP;
+    msg->speed = motor_sim.speed;
+    msg->x_max_steps = motor_sim.x_max;
+    msg->y_max_steps = motor_sim.y_max;
+    msg->inversion_state = 0;
+    break;
+  case MOTOR_SPEED:
+    motor_sim_speed(&motor_sim, *(int *) arg);
+    break;
+  case MOTOR_GOBACK:
+    motor_sim_goback(&motor_sim);
+    break;
+  case MOTOR_CRUISE:
+    motor_sim_cruise(&motor_sim);
+    break;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+const struct motor_backend kernel_backend = { "kernel", kernel_open, kernel_ioctl };
+const struct motor_backend sim_backend = { "simulated", sim_open, sim_ioctl };
+
+void motor_ioctl(int cmd, void *arg)
+{
+  //anything but a status read may change what the motor reports, readers
+  //must not see the old status as current while a slow ioctl is running
+  if (cmd != MOTOR_GET_STATUS) {
+    status_cache.valid = false;
+    status_publish(NULL, true);
+    status_timer_arm(true);
+  }
+  //the journal must not claim a stopped position once the motor may move
+  if (cmd == MOTOR_MOVE || cmd == MOTOR_RESET || cmd == MOTOR_GOBACK || cmd == MOTOR_CRUISE)
+    journal_update(true);
+  //basically exists to not pass around the motor FD
+  uint64_t started = now_us();
+  backend->ioctl(cmd, arg);
+  if (cmd >= 1 && cmd <= MOTOR_METRICS_IOCTLS) {
+    unsigned int seq = atomic_load_explicit(&ioctl_metrics.seq, memory_order_relaxed);
+    atomic_store_explicit(&ioctl_metrics.seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    histogram_add(&ioctl_metrics.by_cmd[cmd - 1], now_us() - started);
+    atomic_store_explicit(&ioctl_metrics.seq, seq + 2, memory_order_release);
+  }
+  TRACE(TRACE_IOCTL, cmd, now_us() - started, 0, 0);
+}
+
+/*
+ * Put the driver back at the journaled position without a sweep. Only a
+ * record of a stopped motor inside its travel range is trusted.
+ */
+bool journal_restore()
+{
+  const struct motor_journal_record *rec = journal ? motor_journal_latest(journal) : NULL;
+  struct motor_reset_data motor_reset_data;
+
+  if (rec == NULL || rec->moving || rec->x_max_steps == 0 || rec->y_max_steps == 0 ||
+      rec->x < 0 || rec->y < 0 || (unsigned int) rec->x > rec->x_max_steps ||
+      (unsigned int) rec->y > rec->y_max_steps)
+    return false;
+
+  motor_reset_data.x_max_steps = rec->x_max_steps;
+  motor_reset_data.y_max_steps = rec->y_max_steps;
+  motor_reset_data.x_cur_step = rec->x;
+  motor_reset_data.y_cur_step = rec->y;
+  motor_inversion_state = rec->inversion_state & MOTOR_INVERT_BOTH;
+  syslog(LOG_INFO, "Restoring position X %d, Y %d of %u x %u from %s, skipping homing",
+         rec->x, rec->y, rec->x_max_steps, rec->y_max_steps, journal_path);
+  motor_ioctl(MOTOR_RESET, &motor_reset_data);
+  return true;
+}
+
+/* a real status read, the estimate starts over from it */
+static void motion_sample(const struct motor_message *msg, long long now)
+{
+  motion.stamp_ms = now;
+  motion.x = msg->x;
+  motion.y = msg->y;
+  if (msg->status != MOTOR_IS_RUNNING) {
+    motion.to_x = msg->x;
+    motion.to_y = msg->y;
+    motion.vx = 0;
+    motion.vy = 0;
+  }
+}
+
+/*
+ * A piece of dx, dy steps was just handed to the driver. The driver steps
+ * both axes at speed, so the shorter one gets to its end first and stops
+ * there while the other goes on.
+ */
+static void motion_piece(int dx, int dy, int speed)
+{
+  motion.stamp_ms = now_ms();
+  motion.x = status_cache.msg.x;
+  motion.y = status_cache.msg.y;
+  motion.to_x = motion.x + dx;
+  motion.to_y = motion.y + dy;
+  motion.vx = dx > 0 ? speed : (dx < 0 ? -speed : 0);
+  motion.vy = dy > 0 ? speed : (dy < 0 ? -speed : 0);
+}
+
+/* the motor was told to stop, hold the estimate where it has got to */
+static void motion_halt()
+{
+  long long now = now_ms();
+  int x, y;
+
+  motor_motion_estimate(&motion, now, &x, &y);
+  motion.stamp_ms = now;
+  motion.x = motion.to_x = x;
+  motion.y = motion.to_y = y;
+  motion.vx = 0;
+  motion.vy = 0;
+}
+
+/*
+ * A stopped motor the daemon still counts as busy, with a move waiting for
+ * its tick or in velocity mode, is not published as current: page readers
+ * would report it idle where motor_status_get() does not.
+ */
+static bool status_page_stale(const struct motor_message *msg)
+{
+  return msg->status == MOTOR_IS_STOP && (move_request.pending || velocity.active);
+}
+
+/*
+ * Status lookup through the cache. An idle snapshot is always served, a
+ * running one only while it is younger than max_age_ms.
+ */
+void motor_status_cached(struct motor_message *msg, int max_age_ms)
+{
+  long long now = now_ms();
+
+  if (status_cache.valid &&
+      (status_cache.msg.status == MOTOR_IS_STOP || now - status_cache.stamp < max_age_ms)) {
+    status_cache.hits++;
+    *msg = status_cache.msg;
+    return;
+  }
+
+  motor_ioctl(MOTOR_GET_STATUS, msg);
+  motion_sample(msg, now);
+  status_cache.ioctls++;
+  status_cache.msg = *msg;
+  status_cache.stamp = now;
+  status_cache.valid = true;
+  status_publish(msg, status_page_stale(msg));
+  status_timer_arm(msg->status == MOTOR_IS_RUNNING);
+}
+
+/*
+ * Status for read-only queries, may be up to status_refresh_ms old while
+ * running. A move that is still waiting for its control tick already counts
+ * as running, so a busy check right after a move request never reads idle.
+ */
+void motor_status_get(struct motor_message *msg)
+{
+  motor_status_cached(msg, status_refresh_ms);
+  if (move_request.pending || velocity.active)
+    msg->status = MOTOR_IS_RUNNING;
+}
+
+/* status for commands that act on the current position, never stale */
+void motor_status_fresh(struct motor_message *msg)
+{
+  motor_status_cached(msg, 0);
+}
+
+void motor_get_maxsteps(unsigned int *maxx, unsigned int *maxy)
+{
+  struct motor_message msg;
+  motor_status_get(&msg);
+  if (maxx)
+    *maxx = msg.x_max_steps;
+  if (maxy)
+    *maxy = msg.y_max_steps;
+}
+
+int motor_is_busy()
+{
+  struct motor_message msg;
+  motor_status_get(&msg);
+  return msg.status == MOTOR_IS_RUNNING ? 1 : 0;
+}
+
+/* one-shot control timer, 0 disarms it */
+void control_timer_set(int ms)
+{
+  struct itimerspec its;
+
+  if (control_timerfd == -1)
+    return;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  timerfd_settime(control_timerfd, 0, &its, NULL);
+}
+
+/* drop whatever is left of the current move */
+void plan_cancel()
+{
+  plan_len = 0;
+  plan_pos = 0;
+  plan_done = 0;
+  piece_running = false;
+  control_timer_set(0);
+}
+
+/* the driver keeps its speed between moves, only send it when it changes */
+void motor_speed_set(int speed)
+{
+  if (speed == driver_speed)
+    return;
+  motor_ioctl(MOTOR_SPEED, &speed);
+  driver_speed = speed;
+}
+
+/*
+ * Hand the next piece of the plan to the driver: the rest of the current
+ * segment, or with interpolation on its next sub-move of at most
+ * interp_steps steps.
+ */
+void plan_issue_next()
+{
+  struct motor_segment sub = planner_chunk(&plan[plan_pos], plan_done, planner_config.interp_steps);
+  struct motors_steps steps;
+
+  plan_done += planner_major(&sub);
+  if (plan_done >= planner_major(&plan[plan_pos])) {
+    plan_pos++;
+    plan_done = 0;
+  }
+
+  steps.x = sub.x;
+  steps.y = sub.y;
+  TRACE(TRACE_SEGMENT, steps.x, steps.y, sub.speed, plan_pos);
+  motor_speed_set(sub.speed);
+  motor_ioctl(MOTOR_MOVE, &steps);
+  motion_piece(steps.x, steps.y, sub.speed);
+
+  // wake up when this piece should be done
+  piece_running = true;
+  piece_started = now_ms();
+  piece_ms = planner_segment_ms(&sub);
+  control_timer_set(piece_ms);
+}
+
+static int clamp_steps(int v, unsigned int max)
+{
+  if (v < 0)
+    return 0;
+  if (max != 0 && v > (int) max)
+    return max;
+  return v;
+}
+
+/*
+ * Next piece of continuous motion from the stopped position in msg, kept
+ * inside the travel range. Returns false once velocity mode has ended.
+ */
+static bool velocity_issue(struct motor_message *msg)
+{
+  struct motor_segment seg;
+  long long now = now_ms();
+  int tx, ty;
+
+  if (!velocity.active)
+    return false;
+  if (now - velocity.refreshed > velocity_deadman_ms) {
+    TRACE(TRACE_DEADMAN, velocity_deadman_ms, 0, 0, 0);
+    velocity.active = false;
+    status_publish(msg, false);
+    return false;
+  }
+
+  seg.x = (long long) velocity.vx * VELOCITY_SEGMENT_MS / 1000;
+  seg.y = (long long) velocity.vy * VELOCITY_SEGMENT_MS / 1000;
+  if (seg.x == 0 && velocity.vx != 0)
+    seg.x = velocity.vx > 0 ? 1 : -1;
+  if (seg.y == 0 && velocity.vy != 0)
+    seg.y = velocity.vy > 0 ? 1 : -1;
+  tx = clamp_steps(msg->x + seg.x, msg->x_max_steps);
+  ty = clamp_steps(msg->y + seg.y, msg->y_max_steps);
+  seg.x = tx - msg->x;
+  seg.y = ty - msg->y;
+  seg.speed = planner_abs(velocity.vx) > planner_abs(velocity.vy) ? planner_abs(velocity.vx) : planner_abs(velocity.vy);
+
+  plan[0] = seg;
+  plan_len = 1;
+  plan_pos = 0;
+  plan_done = 0;
+  plan_speed = seg.speed;
+  plan_end_x = tx;
+  plan_end_y = ty;
+
+  if (seg.x == 0 && seg.y == 0) {
+    // up against the end of travel, nothing runs, only keep watching for a
+    // new direction and the deadman
+    plan_len = 0;
+    piece_running = false;
+    status_publish(msg, true);
+    control_timer_set(VELOCITY_SEGMENT_MS);
+    return true;
+  }
+
+  motor_speed_set(seg.speed);
+  struct motors_steps steps = { seg.x, seg.y };
+  motor_ioctl(MOTOR_MOVE, &steps);
+  motion_piece(seg.x, seg.y, seg.speed);
+  plan_pos = 1;
+  piece_running = true;
+  piece_started = now;
+  piece_ms = planner_segment_ms(&seg);
+  control_timer_set(piece_ms);
+  return true;
+}
+
+/*
+ * Hand the next piece to the driver once the running one has finished.
+ * When the last one is done the driver speed goes back to the requested
+ * cruise speed, so status and later kernel moves report the speed asked for.
+ */
+void plan_tick()
+{
+  struct motor_message msg;
+
+  if (!piece_running) {
+    // velocity mode parked at the end of travel, see velocity_issue
+    if (velocity.active) {
+      motor_status_fresh(&msg);
+      velocity_issue(&msg);
+    }
+    return;
+  }
+  motor_status_fresh(&msg);
+  if (msg.status == MOTOR_IS_RUNNING) {
+    control_timer_set(PLAN_POLL_MS);
+    return;
+  }
+  piece_running = false;
+  if (plan_pos < plan_len) {
+    plan_issue_next();
+    return;
+  }
+  if (velocity_issue(&msg))
+    return;
+  motor_speed_set(plan_speed);
+  plan_cancel();
+}
+
+/* steps of the current plan that have not been handed to the driver yet */
+static void plan_remaining(int *x, int *y)
+{
+  int i;
+  *x = 0;
+  *y = 0;
+  for (i = plan_pos; i < plan_len; i++) {
+    struct motor_segment rest = planner_chunk(&plan[i], i == plan_pos ? plan_done : 0, 0);
+    *x += rest.x;
+    *y += rest.y;
+  }
+}
+
+/*
+ * Plan a move from (fromx, fromy) to (tox, toy) in driver coordinates. With
+ * deferred set a piece of the previous plan is still running, the new plan
+ * starts from where that piece ends once plan_tick sees it finish.
+ */
+void plan_start(int fromx, int fromy, int tox, int toy, int stepspeed, bool deferred)
+{
+  plan_len = planner_plan(&planner_config, tox - fromx, toy - fromy, stepspeed, plan, PLANNER_MAX_SEGMENTS);
+  plan_pos = 0;
+  plan_done = 0;
+  plan_speed = stepspeed;
+  plan_end_x = tox;
+  plan_end_y = toy;
+  TRACE(TRACE_MOVE, fromx, fromy, tox, toy);
+  TRACE(TRACE_PLAN, stepspeed, plan_len, deferred, 0);
+
+  if (deferred)
+    return;
+  if (plan_len == 0) {
+    // nothing to move, still hand the speed to the driver as before
+    motor_speed_set(stepspeed);
+    return;
+  }
+  plan_issue_next();
+}
+
+static void flush_timer_set(int ms)
+{
+  struct itimerspec its;
+
+  if (flush_timerfd == -1)
+    return;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  timerfd_settime(flush_timerfd, 0, &its, NULL);
+}
+
+/*
+ * Turn the pending target into one move. A running piece that is about to
+ * end is left alone and the new plan continues from its end point; one that
+ * would keep the motor going the old way for longer is stopped first.
+ */
+void move_flush()
+{
+  struct motor_message msg;
+  long long now = now_ms();
+  int fromx, fromy;
+  bool deferred = false;
+
+  if (!move_request.pending)
+    return;
+  if (now - move_last_flush < coalesce_ms) {
+    flush_timer_set(move_last_flush + coalesce_ms - now);
+    return;
+  }
+  move_last_flush = now;
+  move_request.pending = false;
+  if (move_request.count > 1)
+    TRACE(TRACE_MERGED, move_request.count, 0, 0, 0);
+
+  if (piece_running && piece_started + piece_ms - now <= 2 * coalesce_ms) {
+    int restx, resty;
+    plan_remaining(&restx, &resty);
+    fromx = plan_end_x - restx;
+    fromy = plan_end_y - resty;
+    deferred = true;
+  } else {
+    if (piece_running) {
+      plan_cancel();
+      motor_ioctl(MOTOR_STOP, NULL);
+    }
+    motor_status_fresh(&msg);
+    fromx = msg.x;
+    fromy = msg.y;
+  }
+  plan_start(fromx, fromy, move_request.x, move_request.y, move_request.speed, deferred);
+}
+
+/* where the motor is headed, in driver coordinates */
+static void move_base(int *x, int *y)
+{
+  struct motor_message msg;
+
+  if (move_request.pending) {
+    *x = move_request.x;
+    *y = move_request.y;
+  } else if (piece_running) {
+    *x = plan_end_x;
+    *y = plan_end_y;
+  } else {
+    motor_status_fresh(&msg);
+    *x = msg.x;
+    *y = msg.y;
+  }
+}
+
+static void move_queue(int x, int y, int stepspeed)
+{
+  velocity.active = false;
+  moves_received++;
+  if (move_request.pending) {
+    moves_merged++;
+    move_request.count++;
+  } else {
+    move_request.count = 1;
+  }
+  move_request.pending = true;
+  move_request.x = x;
+  move_request.y = y;
+  move_request.speed = stepspeed;
+  status_publish(NULL, true);
+}
+
+/* forget a move that has not reached the driver yet */
+void move_discard()
+{
+  move_request.pending = false;
+  flush_timer_set(0);
+}
+
+/* end velocity mode right away */
+void velocity_stop()
+{
+  if (!velocity.active)
+    return;
+  velocity.active = false;
+  if (piece_running) {
+    plan_cancel();
+    motor_ioctl(MOTOR_STOP, NULL);
+  } else if (status_cache.valid) {
+    // parked at the end of travel, the stopped status is current again
+    control_timer_set(0);
+    status_publish(&status_cache.msg, false);
+  }
+}
+
+/*
+ * Start or refresh continuous motion, rates are in user directions. Queued
+ * moves are dropped, a piece that is already running is allowed to finish
+ * and the motion continues from its end.
+ */
+void motor_velocity(int vx, int vy)
+{
+  struct motor_message msg;
+
+  if (vx == 0 && vy == 0) {
+    velocity_stop();
+    return;
+  }
+
+  // Apply the correct inversion based on the motor_inversion_state
+  velocity.vx = (motor_inversion_state & MOTOR_INVERT_X) ? -vx : vx;
+  velocity.vy = (motor_inversion_state & MOTOR_INVERT_Y) ? -vy : vy;
+  velocity.refreshed = now_ms();
+  if (velocity.active)
+    return;
+
+  TRACE(TRACE_VELOCITY, vx, vy, 0, 0);
+  move_discard();
+  velocity.active = true;
+  if (piece_running) {
+    int restx, resty;
+    plan_remaining(&restx, &resty);
+    plan_end_x -= restx;
+    plan_end_y -= resty;
+    plan_len = 0;
+    plan_pos = 0;
+    plan_done = 0;
+    return;
+  }
+  motor_status_fresh(&msg);
+  velocity_issue(&msg);
+}
+
+/* relative move, steps are in user directions */
+void motor_steps(int xsteps, int ysteps, int stepspeed) {
+  int x, y;
+
+  // Apply the correct inversion based on the motor_inversion_state
+  if (motor_inversion_state & MOTOR_INVERT_X)
+    xsteps = -xsteps;
+  if (motor_inversion_state & MOTOR_INVERT_Y)
+    ysteps = -ysteps;
+
+  move_base(&x, &y);
+  TRACE(TRACE_QUEUE, xsteps, ysteps, stepspeed, 1);
+  move_queue(x + xsteps, y + ysteps, stepspeed);
+}
+
+/* absolute move, positions are driver coordinates as reported by status */
+void motor_set_position(int xpos, int ypos, int stepspeed) {
+  TRACE(TRACE_QUEUE, xpos, ypos, stepspeed, 0);
+  move_queue(xpos, ypos, stepspeed);
+}
+
+static int round_steps(double v)
+{
+  return (int) (v < 0 ? v - 0.5 : v + 0.5);
+}
+
+/* how far the sent target may move towards aim, limited to max steps */
+static int slew_limit(int sent, int aim, double max)
+{
+  if (aim - sent > max)
+    return sent + (int) max;
+  if (sent - aim > max)
+    return sent - (int) max;
+  return aim;
+}
+
+/* one tracking target, driver coordinates like an absolute move */
+void motor_track(int tx, int ty, int stepspeed)
+{
+  long long now = now_ms();
+  int aimx, aimy, x, y;
+
+  targets_received++;
+  if (!tracker.active || now - tracker.updated > TRACK_GAP_MS) {
+    move_base(&x, &y);
+    tracker.active = true;
+    tracker.x = tx;
+    tracker.y = ty;
+    tracker.vx = 0;
+    tracker.vy = 0;
+    tracker.sent_x = x;
+    tracker.sent_y = y;
+    tracker.sent_at = now;
+  } else {
+    // targets that bunch up in a socket buffer would otherwise read as huge rates
+    double dt = (now - tracker.updated > TRACK_MIN_DT_MS ? now - tracker.updated : TRACK_MIN_DT_MS) / 1000.0;
+    double rx = tx - (tracker.x + tracker.vx * dt);
+    double ry = ty - (tracker.y + tracker.vy * dt);
+    tracker.x += tracker.vx * dt + track_alpha * rx;
+    tracker.y += tracker.vy * dt + track_alpha * ry;
+    tracker.vx += track_beta * rx / dt;
+    tracker.vy += track_beta * ry / dt;
+  }
+  tracker.updated = now;
+
+  // aim where the target will be once the next tick hands the move over
+  aimx = round_steps(tracker.x + tracker.vx * coalesce_ms / 1000.0);
+  aimy = round_steps(tracker.y + tracker.vy * coalesce_ms / 1000.0);
+  if (abs(aimx - tracker.sent_x) <= track_deadband && abs(aimy - tracker.sent_y) <= track_deadband)
+    return;
+  if (track_slew > 0) {
+    double max = track_slew * ((now - tracker.sent_at < TRACK_GAP_MS ? now - tracker.sent_at : TRACK_GAP_MS) / 1000.0);
+    aimx = slew_limit(tracker.sent_x, aimx, max);
+    aimy = slew_limit(tracker.sent_y, aimy, max);
+    if (aimx == tracker.sent_x && aimy == tracker.sent_y)
+      return;
+  }
+  tracker.sent_x = aimx;
+  tracker.sent_y = aimy;
+  tracker.sent_at = now;
+  target_moves++;
+  TRACE(TRACE_TRACK, tx, ty, aimx, aimy);
+  move_queue(aimx, aimy, stepspeed);
+}
+
+/*
+ * Control thread side. Anything still queued, planned or running, or an
+ * ioctl that is holding the control thread, counts as busy.
+ */
+static void snapshot_publish()
+{
+    struct daemon_view *view = &snapshot.view;
+    unsigned int seq = atomic_load_explicit(&snapshot.seq, memory_order_relaxed);
+
+    atomic_store_explicit(&snapshot.seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    view->msg = status_cache.msg;
+    view->msg.inversion_state = motor_inversion_state;
+    view->busy = homing || move_request.pending || velocity.active || piece_running ||
+                 !status_cache.valid || status_cache.msg.status == MOTOR_IS_RUNNING;
+    view->homing = homing;
+    view->done = command_done;
+    view->motion = motion;
+    view->counters.ioctls = status_cache.ioctls;
+    view->counters.hits = status_cache.hits;
+    view->counters.moves = moves_received;
+    view->counters.merged = moves_merged;
+    view->counters.targets = targets_received;
+    view->counters.target_moves = target_moves;
+    view->counters.ready_ms = ready_ms;
+    view->counters.homed_ms = homed_ms;
+    atomic_store_explicit(&snapshot.seq, seq + 2, memory_order_release);
+    eventfd_signal(status_eventfd);
+}
+
+/* moves and resets queued before a stop are dropped, settings still apply */
+static bool command_moves(const struct request *req)
+{
+    return req->command == 'd' || req->command == 'r';
+}
+
+/* handle a stop the I/O thread has posted since the last look */
+static void control_stop_check()
+{
+    uint32_t stop = atomic_load_explicit(&stop_seq, memory_order_acquire);
+
+    if (stop == stop_handled)
+        return;
+    stop_handled = stop;
+    velocity.active = false;
+    tracker.active = false;
+    move_discard();
+    plan_cancel();
+    motor_ioctl(MOTOR_STOP, NULL);
+    motion_halt();
+    if (seq_before(command_done, stop))
+        command_done = stop;
+}
+
+/* run one queued command on the control thread */
+static void control_handle(struct motor_command *cmd)
+{
+    struct request *req = &cmd->req;
+    struct motor_reset_data motor_reset_data;
+    int x, y;
+
+    TRACE(TRACE_COMMAND, req->command | req->type << 8, req->x, req->y, req->speed);
+    // any other move ends tracking, the next target starts it afresh
+    if (command_moves(req) && !(req->command == 'd' && req->type == 'k'))
+        tracker.active = false;
+
+    switch (req->command) {
+    case 'd':
+        switch (req->type) {
+        case 'k': // tracking target, absolute
+            motor_track(req->x, req->y, req->speed);
+            break;
+        case 'g': // relative movement
+            motor_steps(req->x, req->y, req->speed);
+            break;
+        case 'h': // absolute movement, a missing axis stays where it is headed
+            move_base(&x, &y);
+            motor_set_position(req->got_x ? req->x : x, req->got_y ? req->y : y, req->speed);
+            break;
+        case 'v': // continuous velocity, x and y in steps/s
+            motor_velocity(req->x, req->y);
+            break;
+        case 'b': // go back
+            velocity_stop();
+            move_discard();
+            plan_cancel();
+            driver_speed = -1;
+            motor_ioctl(MOTOR_GOBACK, NULL);
+            break;
+        case 'c': // cruise
+            velocity_stop();
+            move_discard();
+            plan_cancel();
+            driver_speed = -1;
+            motor_ioctl(MOTOR_CRUISE, NULL);
+            break;
+        }
+        break;
+    case 'r':
+        //cleanup of reset data before reset, is necesary otherwise reset is never performed even though it never fails
+        memset(&motor_reset_data, 0, sizeof(motor_reset_data));
+        velocity.active = false;
+        move_discard();
+        plan_cancel();
+        driver_speed = -1;
+        // the sweep holds this thread until it is done, status keeps being served meanwhile
+        homing = true;
+        motion_halt();
+        snapshot_publish();
+        motor_ioctl(MOTOR_RESET, &motor_reset_data);
+        homing = false;
+        if (homed_ms == 0) {
+            homed_ms = now_ms() - started_ms;
+            syslog(LOG_INFO, "Homing done %u ms after start, %lld ms after boot", homed_ms, boot_ms());
+        }
+        break;
+    case 's':
+        driver_speed = req->speed;
+        motor_ioctl(MOTOR_SPEED, &req->speed);
+        break;
+    case 'I':
+        if (req->type == 'x')
+            motor_inversion_state ^= MOTOR_INVERT_X;
+        else if (req->type == 'y')
+            motor_inversion_state ^= MOTOR_INVERT_Y;
+        else
+            motor_inversion_state ^= MOTOR_INVERT_BOTH;
+        if (status_cache.valid)
+            status_publish(&status_cache.msg, status_page_stale(&status_cache.msg));
+        break;
+    }
+}
+
+/*
+ * Take everything the I/O thread has queued. A stop is looked for again
+ * after every command is taken off the queue, so one posted meanwhile still
+ * runs before any command that was sent after it.
+ */
+static void command_drain()
+{
+    struct motor_command cmd;
+
+    eventfd_clear(command_eventfd);
+    control_stop_check();
+    while (command_pop(&cmd)) {
+        control_stop_check();
+        if (seq_before(cmd.seq, stop_handled) && command_moves(&cmd.req))
+            TRACE(TRACE_DROPPED, cmd.req.command | cmd.req.type << 8, 0, 0, 0);
+        else
+            control_handle(&cmd);
+        if (seq_before(command_done, cmd.seq))
+            command_done = cmd.seq;
+    }
+    status_done();
+}
+
+int check_pid(char *file_name)
+{
+    FILE *f;
+    long pid;
+    char pid_buffer[PID_SIZE];
+
+    f = fopen(file_name, "r");
+    if(f == NULL)
+        return 0;
+
+    if (fgets(pid_buffer, PID_SIZE, f) == NULL) {
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+
+    if (sscanf(pid_buffer, "%ld", &pid) != 1) {
+        return 0;
+    }
+
+    if (kill(pid, 0) == 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+int create_pid(char *file_name)
+{
+    FILE *f;
+    char pid_buffer[PID_SIZE];
+
+    f = fopen(file_name, "w");
+    if (f == NULL)
+        return -1;
+
+    memset(pid_buffer, '\0', PID_SIZE);
+    sprintf(pid_buffer, "%ld\n", (long) getpid());
+    if (fwrite(pid_buffer, strlen(pid_buffer), 1, f) != 1) {
+        fclose(f);
+        return -2;
+    }
+    fclose(f);
+
+    return 0;
+}
+
+/*
+ * Close every descriptor inherited from the parent. Only the ones that are
+ * actually open are listed in /proc/self/fd, which saves calling close() up
+ * to _SC_OPEN_MAX times. stdin, stdout and stderr end up on /dev/null, so a
+ * socket opened later can never take their place and receive stray output.
+ */
+static void close_inherited_fds()
+{
+    DIR *dir = opendir("/proc/self/fd");
+    int fd;
+
+    if (dir != NULL) {
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL) {
+            if (de->d_name[0] < '0' || de->d_name[0] > '9')
+                continue;
+            fd = atoi(de->d_name);
+            if (fd != dirfd(dir))
+                close(fd);
+        }
+        closedir(dir);
+    } else {
+        for (fd = sysconf(_SC_OPEN_MAX); fd >= 0; fd--)
+            close(fd);
+    }
+
+    fd = open("/dev/null", O_RDWR);
+    if (fd != -1) {
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if (fd > STDERR_FILENO)
+            close(fd);
+    }
+}
+
+static void daemonsetup()
+{
+    pid_t pid;
+
+    /* Fork off the parent process */
+    pid = fork();
+
+    /* An error occurred */
+    if (pid < 0)
+        exit(EXIT_FAILURE);
+
+    /* Success: Let the parent terminate */
+    if (pid > 0)
+        exit(EXIT_SUCCESS);
+
+    /* On success: The child process becomes session leader */
+    if (setsid() < 0)
+        exit(EXIT_FAILURE);
+
+    /* Catch, ignore and handle signals */
+    //TODO: Implement a working signal handler */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+
+    /* Fork off for the second time*/
+    pid = fork();
+
+    /* An error occurred */
+    if (pid < 0)
+        exit(EXIT_FAILURE);
+
+    /* Success: Let the parent terminate */
+    if (pid > 0)
+        exit(EXIT_SUCCESS);
+
+    /* Set new file permissions */
+    umask(0);
+
+    /* Change the working directory */
+    chdir("/dev/");
+
+    /* Close all open file descriptors */
+    close_inherited_fds();
+
+    /* Open the log file */
+    openlog ("motors-daemon", LOG_PID, LOG_DAEMON);
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * Request capture for motor-replay. Records collect in capture_buf and are
+ * written in one go once it fills up or CAPTURE_FLUSH_MS after the first of
+ * them, so capturing adds no syscall to a request. While the motor runs the
+ * position is captured at the same pace, the last one is where it stopped.
+ */
+static void capture_setup()
+{
+    struct motor_capture_header hdr;
+
+    if (capture_path == NULL)
+        return;
+    capture_fd = open(capture_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (capture_fd == -1) {
+        syslog(LOG_INFO, "Could not open %s, requests not captured", capture_path);
+        return;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = MOTOR_CAPTURE_MAGIC;
+    hdr.version = MOTOR_CAPTURE_VERSION;
+    hdr.started = time(NULL);
+    if (write(capture_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        syslog(LOG_INFO, "Could not write %s, requests not captured", capture_path);
+        close(capture_fd);
+        capture_fd = -1;
+        return;
+    }
+    capture_started_us = now_us();
+    syslog(LOG_INFO, "Capturing requests to %s", capture_path);
+}
+
+static void capture_flush()
+{
+    size_t off = 0;
+
+    while (capture_fd != -1 && off < capture_len) {
+        ssize_t n = write(capture_fd, capture_buf + off, capture_len - off);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            syslog(LOG_INFO, "Could not write %s, request capture stopped", capture_path);
+            close(capture_fd);
+            capture_fd = -1;
+            break;
+        }
+        off += n;
+    }
+    capture_len = 0;
+}
+
+static void capture_add(uint8_t kind, uint32_t conn, uint32_t id, int status, uint16_t flags,
+                        const void *data, size_t len)
+{
+    struct motor_capture_record rec;
+
+    if (capture_fd == -1)
+        return;
+    if (capture_len + sizeof(rec) + len > sizeof(capture_buf))
+        capture_flush();
+    if (capture_fd == -1)
+        return;
+    if (capture_len == 0 && !capture_moving)
+        capture_due = now_ms() + CAPTURE_FLUSH_MS;
+    memset(&rec, 0, sizeof(rec));
+    rec.stamp_us = now_us() - capture_started_us;
+    rec.conn = conn;
+    rec.id = id;
+    rec.kind = kind;
+    rec.status = status;
+    rec.flags = flags;
+    rec.length = len;
+    memcpy(capture_buf + capture_len, &rec, sizeof(rec));
+    if (len != 0)
+        memcpy(capture_buf + capture_len + sizeof(rec), data, len);
+    capture_len += sizeof(rec) + len;
+}
+
+static void capture_position()
+{
+    struct daemon_view view;
+
+    snapshot_read(&view);
+    capture_add(MOTOR_CAPTURE_POSITION, 0, 0, MOTOR_OK, 0, &view.msg, sizeof(view.msg));
+    capture_moving = view.msg.status != MOTOR_IS_STOP;
+}
+
+static void capture_request(struct client *cl, struct motor_frame *hdr, const void *payload)
+{
+    if (capture_fd == -1)
+        return;
+    if (!capture_positioned) {
+        capture_position();
+        capture_positioned = true;
+    }
+    capture_add(MOTOR_CAPTURE_REQUEST, cl->serial, hdr->id, MOTOR_OK, hdr->flags, payload, hdr->length);
+}
+
+/* from the main loop, write out what is due along with the position */
+static void capture_tick()
+{
+    long long now = now_ms();
+
+    if (capture_fd == -1 || (capture_len == 0 && !capture_moving) || now < capture_due)
+        return;
+    capture_position();
+    capture_flush();
+    capture_due = now + CAPTURE_FLUSH_MS;
+}
+
+/*
+ * Client connections are non-blocking and owned by the epoll loop. Each one
+ * buffers a partially received request and a partially sent reply, so a
+ * client that stops reading or writing only ever stalls itself.
+ */
+static void client_close(struct client *cl)
+{
+    TRACE(TRACE_CLOSE, cl->fd, cl->inlen, 0, 0);
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, cl->fd, NULL);
+    close(cl->fd);
+    cl->fd = -1;
+    nclients--;
+    if (cl->waiting) {
+        cl->waiting = false;
+        nwaiters--;
+    }
+    if (cl->subscribed) {
+        cl->subscribed = false;
+        nsubscribers--;
+    }
+}
+
+static struct client *client_alloc(int fd)
+{
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd == -1) {
+            memset(&clients[i], 0, sizeof(struct client));
+            clients[i].fd = fd;
+            clients[i].last_active = now_ms();
+            nclients++;
+            return &clients[i];
+        }
+    }
+    return NULL;
+}
+
+static void client_watch(struct client *cl, uint32_t events)
+{
+    struct epoll_event ev;
+    if (cl->events == events)
+        return;
+    ev.events = events;
+    ev.data.ptr = cl;
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, cl->fd, &ev);
+    cl->events = events;
+}
+
+/* queue one frame for the client, payload may be NULL when len is 0 */
+static void client_frame(struct client *cl, uint8_t kind, uint32_t id, int status, uint16_t flags,
+                         const void *data, size_t len)
+{
+    struct motor_frame hdr;
+
+    if (cl->outlen + sizeof(hdr) + len > CLIENT_OUT_SIZE) {
+        TRACE(TRACE_OVERFLOW, cl->fd, sizeof(hdr) + len, 0, 0);
+        return;
+    }
+    motor_frame_init(&hdr, kind, id, len);
+    hdr.status = status;
+    hdr.flags = flags;
+    memcpy(cl->outbuf + cl->outlen, &hdr, sizeof(hdr));
+    if (len != 0)
+        memcpy(cl->outbuf + cl->outlen + sizeof(hdr), data, len);
+    cl->outlen += sizeof(hdr) + len;
+}
+
+static void client_reply(struct client *cl, uint32_t id, int status, const void *data, size_t len)
+{
+    TRACE(TRACE_REPLY, id, status, len, cl->fd);
+    capture_add(MOTOR_CAPTURE_REPLY, cl->serial, id, status, 0, NULL, 0);
+    client_frame(cl, MOTOR_FRAME_REPLY, id, status, 0, data, len);
+}
+
+/*
+ * Park the client until every command it has sent so far is done, and with
+ * idle set until the motor is idle too. waiters_check() sends the reply.
+ */
+static void client_wait(struct client *cl, uint32_t id, int timeout_ms, bool idle)
+{
+    cl->waiting = true;
+    cl->wait_id = id;
+    cl->wait_seq = command_seq;
+    cl->wait_idle = idle;
+    cl->wait_deadline = now_ms() + timeout_ms;
+    nwaiters++;
+}
+
+/* commands queued and not taken by the control thread yet */
+static unsigned int command_depth()
+{
+    return atomic_load_explicit(&command_queue.head, memory_order_relaxed) -
+           atomic_load_explicit(&command_queue.tail, memory_order_acquire);
+}
+
+static int metrics_slot(char command)
+{
+    const char *p = command ? strchr(METRICS_COMMANDS, command) : NULL;
+    return p ? p - METRICS_COMMANDS : (int) sizeof(METRICS_COMMANDS) - 1;
+}
+
+/* everything 'M' answers with, the used command slots after the fixed part */
+static size_t metrics_get(unsigned char *buf)
+{
+    struct motor_metrics *m = (struct motor_metrics *) buf;
+    struct motor_command_metrics cm;
+    size_t len = sizeof(struct motor_metrics);
+    unsigned int seq;
+    size_t i;
+
+    memset(m, 0, sizeof(*m));
+    m->uptime_ms = now_ms() - started_ms;
+    m->connections = nclients;
+    m->connections_peak = metrics.connections_peak;
+    m->accepted = metrics.accepted;
+    m->queue_depth = command_depth();
+    m->queue_peak = metrics.queue_peak;
+    m->socket_read = metrics.socket_read;
+    m->socket_write = metrics.socket_write;
+    do {
+        seq = atomic_load_explicit(&ioctl_metrics.seq, memory_order_acquire);
+        memcpy(m->ioctl, ioctl_metrics.by_cmd, sizeof(m->ioctl));
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || atomic_load_explicit(&ioctl_metrics.seq, memory_order_relaxed) != seq);
+
+    for (i = 0; i < sizeof(METRICS_COMMANDS); i++) {
+        if (metrics.commands[i].count == 0)
+            continue;
+        memset(&cm, 0, sizeof(cm));
+        cm.command = i < sizeof(METRICS_COMMANDS) - 1 ? METRICS_COMMANDS[i] : '?';
+        cm.time = metrics.commands[i];
+        memcpy(buf + len, &cm, sizeof(cm));
+        len += sizeof(cm);
+        m->ncommands++;
+    }
+    return len;
+}
+
+/* hand a request to the control thread with the speed it should run at, the last known one unless it has its own */
+static int command_send(struct request *req)
+{
+    struct motor_command cmd;
+
+    cmd.seq = command_seq + 1;
+    cmd.req = *req;
+    cmd.req.speed = req->speed ? req->speed : last_known_speed;
+    if (!command_push(&cmd)) {
+        syslog(LOG_INFO, "Command queue full, rejecting %c", req->command);
+        return MOTOR_ERR_BUSY;
+    }
+    command_seq = cmd.seq;
+    status_queued(command_seq);
+    if (req->command == 'r')
+        reset_seq = cmd.seq;
+    if (command_depth() > metrics.queue_peak)
+        metrics.queue_peak = command_depth();
+    eventfd_signal(command_eventfd);
+    return MOTOR_OK;
+}
+
+/* a stop never waits behind queued commands, see control_stop_check() */
+static void command_stop()
+{
+    command_seq++;
+    status_queued(command_seq);
+    atomic_store_explicit(&stop_seq, command_seq, memory_order_release);
+    eventfd_signal(command_eventfd);
+}
+
+/* a reset is running or still queued */
+static bool daemon_homing(struct daemon_view *view)
+{
+    return view->homing || seq_before(view->done, reset_seq);
+}
+
+/* status as the daemon sees it: anything not done yet counts as running */
+static void daemon_status(struct motor_message *msg, struct daemon_view *view)
+{
+    snapshot_read(view);
+    *msg = view->msg;
+    if (daemon_homing(view))
+        msg->status = MOTOR_IS_HOMING;
+    else if (view->busy || seq_before(view->done, command_seq))
+        msg->status = MOTOR_IS_RUNNING;
+}
+
+/* status plus where the motion model says the motor is by now */
+static void daemon_status_reply(struct motor_status_reply *reply, struct daemon_view *view)
+{
+    long long now = now_ms();
+    int x, y;
+
+    daemon_status(&reply->msg, view);
+    motor_motion_estimate(&view->motion, now, &x, &y);
+    reply->estimate.x = x;
+    reply->estimate.y = y;
+    reply->estimate.age_ms = now - view->motion.stamp_ms;
+}
+
+/* push status to the client from now on, see subscribers_tick() */
+static void client_subscribe(struct client *cl, uint32_t id, int interval_ms)
+{
+    if (!cl->subscribed)
+        nsubscribers++;
+    cl->subscribed = true;
+    cl->sub_id = id;
+    cl->sub_interval_ms = interval_ms > 0 ? interval_ms : 0;
+    cl->sub_next = 0;
+    memset(&cl->sub_last, 0xff, sizeof(struct motor_message));
+}
+
+/* FNV-1a */
+static unsigned int preset_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h & (PRESET_HASH_SIZE - 1);
+}
+
+/* slot of the preset called name, -1 if there is none */
+static int preset_find_name(const char *name)
+{
+    unsigned int h = preset_hash(name);
+    int probes;
+
+    for (probes = 0; probes < PRESET_HASH_SIZE; probes++, h = (h + 1) & (PRESET_HASH_SIZE - 1)) {
+        int slot = presets.by_name[h] - 1;
+        if (slot < 0)
+            return -1;
+        if (strcmp(presets.slot[slot].name, name) == 0)
+            return slot;
+    }
+    return -1;
+}
+
+/* deletes are rare and the table is small, the hash is simply rebuilt */
+static void preset_index_rebuild()
+{
+    int i;
+
+    memset(presets.by_name, 0, sizeof(presets.by_name));
+    for (i = 0; i < MOTOR_MAX_PRESETS; i++) {
+        unsigned int h;
+        if (presets.slot[i].id == 0 || presets.slot[i].name[0] == '\0')
+            continue;
+        for (h = preset_hash(presets.slot[i].name); presets.by_name[h] != 0; h = (h + 1) & (PRESET_HASH_SIZE - 1))
+            ;
+        presets.by_name[h] = i + 1;
+    }
+}
+
+/* slot the reference picks, by id or else by name, -1 if it does not exist */
+static int preset_lookup(const struct motor_preset *ref)
+{
+    if (ref->id > 0 && ref->id <= MOTOR_MAX_PRESETS)
+        return presets.slot[ref->id - 1].id != 0 ? ref->id - 1 : -1;
+    if (ref->id == 0 && ref->name[0] != '\0')
+        return preset_find_name(ref->name);
+    return -1;
+}
+
+/* write the table to a temporary file and rename it over the old one */
+static void presets_save()
+{
+    struct preset_file head = { PRESET_MAGIC, PRESET_VERSION, 0 };
+    char tmp[256];
+    FILE *f;
+    int i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", preset_path);
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        syslog(LOG_INFO, "Could not write %s, presets not saved", tmp);
+        return;
+    }
+    for (i = 0; i < MOTOR_MAX_PRESETS; i++)
+        head.count += presets.slot[i].id != 0;
+    fwrite(&head, sizeof(head), 1, f);
+    for (i = 0; i < MOTOR_MAX_PRESETS; i++)
+        if (presets.slot[i].id != 0)
+            fwrite(&presets.slot[i], sizeof(struct motor_preset), 1, f);
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0 || rename(tmp, preset_path) != 0) {
+        syslog(LOG_INFO, "Could not write %s, presets not saved", preset_path);
+        unlink(tmp);
+    }
+}
+
+static void presets_load()
+{
+    struct preset_file head;
+    struct motor_preset p;
+    FILE *f = fopen(preset_path, "r");
+    int i;
+
+    if (f == NULL)
+        return;
+    if (fread(&head, sizeof(head), 1, f) != 1 || head.magic != PRESET_MAGIC || head.version != PRESET_VERSION) {
+        syslog(LOG_INFO, "Ignoring %s, not a preset file", preset_path);
+        fclose(f);
+        return;
+    }
+    for (i = 0; i < head.count && fread(&p, sizeof(p), 1, f) == 1; i++) {
+        if (p.id <= 0 || p.id > MOTOR_MAX_PRESETS)
+            continue;
+        p.name[MOTOR_PRESET_NAME - 1] = '\0';
+        presets.slot[p.id - 1] = p;
+    }
+    fclose(f);
+    preset_index_rebuild();
+    syslog(LOG_INFO, "Loaded %d presets from %s", i, preset_path);
+}
+
+/*
+ * Store a preset at x, y. An id that is taken is overwritten, a name alone
+ * overwrites the preset of that name or takes the first free id.
+ */
+static int preset_set(const struct motor_preset *ref, int x, int y)
+{
+    int slot = ref->id > 0 ? ref->id - 1 : -1;
+    int named = ref->name[0] != '\0' ? preset_find_name(ref->name) : -1;
+
+    if (ref->id < 0 || ref->id > MOTOR_MAX_PRESETS || (ref->id == 0 && ref->name[0] == '\0'))
+        return MOTOR_ERR_NOENT;
+    if (slot >= 0 && named >= 0 && named != slot)
+        return MOTOR_ERR_EXISTS;
+    if (slot < 0)
+        slot = named;
+    for (int i = 0; slot < 0 && i < MOTOR_MAX_PRESETS; i++)
+        if (presets.slot[i].id == 0)
+            slot = i;
+    if (slot < 0)
+        return MOTOR_ERR_FULL;
+
+    presets.slot[slot].id = slot + 1;
+    presets.slot[slot].x = x;
+    presets.slot[slot].y = y;
+    memcpy(presets.slot[slot].name, ref->name, MOTOR_PRESET_NAME);
+    preset_index_rebuild();
+    presets_save();
+    TRACE(TRACE_PRESET, slot + 1, x, y, 0);
+    return MOTOR_OK;
+}
+
+/* queue a move, or refuse it while homing if the request says so */
+static int move_send(const struct motor_frame *hdr, struct request *req)
+{
+    struct daemon_view view;
+
+    snapshot_read(&view);
+    if ((hdr->flags & MOTOR_FLAG_NO_QUEUE) && daemon_homing(&view))
+        return MOTOR_ERR_HOMING;
+    return command_send(req);
+}
+
+/* one-shot route timer, 0 disarms it */
+static void route_timer_set(int ms)
+{
+    struct itimerspec its;
+
+    if (route_timerfd == -1)
+        return;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    timerfd_settime(route_timerfd, 0, &its, NULL);
+}
+
+/* step past the current point, false once the route is over */
+static bool route_advance()
+{
+    if (++route.pos < route.len)
+        return true;
+    if (route.loop) {
+        route.pos = 0;
+        return true;
+    }
+    route.state = MOTOR_ROUTE_IDLE;
+    TRACE(TRACE_ROUTE_DONE, route.kind, 0, 0, 0);
+    return false;
+}
+
+/* head for the current point, skipping points whose preset has been deleted */
+static void route_go()
+{
+    struct request req = { .command = 'd', .type = 'h', .got_x = 1, .got_y = 1 };
+    struct route_point *pt = &route.points[route.pos];
+    int skipped = 0;
+
+    while (pt->preset != 0 && presets.slot[pt->preset - 1].id == 0) {
+        syslog(LOG_INFO, "Route point %d: preset %d is gone, skipping it", route.pos, pt->preset);
+        if (++skipped == route.len || !route_advance()) {
+            route.state = MOTOR_ROUTE_IDLE;
+            return;
+        }
+        pt = &route.points[route.pos];
+    }
+    req.x = pt->preset ? presets.slot[pt->preset - 1].x : pt->x;
+    req.y = pt->preset ? presets.slot[pt->preset - 1].y : pt->y;
+    req.speed = pt->speed;
+    if (command_send(&req) != MOTOR_OK) {
+        route.state = MOTOR_ROUTE_PAUSED;
+        return;
+    }
+    route.move_seq = command_seq;
+    route.state = MOTOR_ROUTE_MOVING;
+    TRACE(TRACE_ROUTE_POINT, route.pos, req.x, req.y, 0);
+}
+
+static void route_next()
+{
+    if (route_advance())
+        route_go();
+}
+
+static void route_status_get(struct motor_route_status *rs)
+{
+    memset(rs, 0, sizeof(*rs));
+    rs->state = route.state;
+    rs->kind = route.kind;
+    rs->loop = route.loop;
+    rs->pos = route.pos;
+    rs->len = route.len;
+}
+
+/* start route.points from the first one, anything the route was doing is dropped */
+static void route_begin(char kind, int len, bool loop)
+{
+    route_timer_set(0);
+    route.kind = kind;
+    route.loop = loop;
+    route.len = len;
+    route.pos = 0;
+    TRACE(TRACE_ROUTE, kind, len, loop, 0);
+    route_go();
+}
+
+/* replace the route with a tour, presets are checked now and followed later */
+static int route_start_tour(const void *data, size_t data_len, bool loop)
 {
-  unsigned int x_max_steps;
-  unsigned int y_max_steps;
-  unsigned int x_cur_step;
-  unsigned int y_cur_step;
-};
+    struct route_point points[MOTOR_MAX_WAYPOINTS];
+    struct motor_waypoint wp;
+    size_t n = data_len / sizeof(struct motor_waypoint);
+    size_t i;
+
+    if (n == 0 || n > MOTOR_MAX_WAYPOINTS || data_len % sizeof(struct motor_waypoint) != 0)
+        return MOTOR_ERR_LENGTH;
+    for (i = 0; i < n; i++) {
+        memcpy(&wp, (const char *) data + i * sizeof(wp), sizeof(wp));
+        wp.at.name[MOTOR_PRESET_NAME - 1] = '\0';
+        points[i].preset = 0;
+        if (wp.at.id != 0 || wp.at.name[0] != '\0') {
+            int slot = preset_lookup(&wp.at);
+            if (slot < 0)
+                return MOTOR_ERR_NOENT;
+            points[i].preset = slot + 1;
+        }
+        points[i].x = wp.at.x;
+        points[i].y = wp.at.y;
+        points[i].speed = wp.speed;
+        points[i].dwell_ms = wp.dwell_ms > 0 ? wp.dwell_ms : 0;
+    }
+    memcpy(route.points, points, n * sizeof(struct route_point));
+    route_begin('t', n, loop);
+    return MOTOR_OK;
+}
 
-int motorfd = -1;
-struct request request_message; // object for IPC request from client
-int last_known_speed = 900; // Default speed
-bool motor_inverted = false; // Global flag for motor inversion
+/* replace the route with a grid scan, in the order planner_scan picks */
+static int route_start_scan(const void *data, size_t data_len, int speed, bool loop)
+{
+    struct motor_scan scan;
+    struct motor_message msg;
+    struct daemon_view view;
+    int xs[ROUTE_MAX_POINTS], ys[ROUTE_MAX_POINTS];
+    int n, i;
+
+    if (data_len != sizeof(struct motor_scan))
+        return MOTOR_ERR_LENGTH;
+    memcpy(&scan, data, sizeof(scan));
+    daemon_status(&msg, &view);
+    if (!(scan.flags & MOTOR_SCAN_BOX)) {
+        scan.x_min = 0;
+        scan.y_min = 0;
+        scan.x_max = msg.x_max_steps;
+        scan.y_max = msg.y_max_steps;
+    }
+    n = planner_scan(scan.x_min, scan.y_min, scan.x_max, scan.y_max, scan.x_step, scan.y_step,
+                     msg.x, msg.y, xs, ys, ROUTE_MAX_POINTS);
+    if (n < 0)
+        return MOTOR_ERR_RANGE;
+
+    for (i = 0; i < n; i++) {
+        route.points[i].x = xs[i];
+        route.points[i].y = ys[i];
+        route.points[i].preset = 0;
+        route.points[i].speed = speed;
+        route.points[i].dwell_ms = scan.dwell_ms > 0 ? scan.dwell_ms : 0;
+    }
+    TRACE(TRACE_SCAN, planner_scan_count(scan.x_min, scan.x_max, scan.x_step),
+          planner_scan_count(scan.y_min, scan.y_max, scan.y_step), xs[0], ys[0]);
+    route_begin('g', n, loop);
+    return MOTOR_OK;
+}
 
-void motor_ioctl(int cmd, void *arg)
+/* stop at the current point, resuming moves back to it and dwells again */
+static void route_pause()
 {
-  //basically exists to not pass around the motor FD
-  ioctl(motorfd, cmd, arg);
+    if (route.state == MOTOR_ROUTE_MOVING)
+        command_stop();
+    if (route.state == MOTOR_ROUTE_MOVING || route.state == MOTOR_ROUTE_DWELL) {
+        route_timer_set(0);
+        route.state = MOTOR_ROUTE_PAUSED;
+    }
 }
 
-void motor_status_get(struct motor_message *msg)
+static void route_resume()
 {
-  motor_ioctl(MOTOR_GET_STATUS, msg);
+    if (route.state == MOTOR_ROUTE_PAUSED)
+        route_go();
 }
 
-void motor_get_maxsteps(unsigned int *maxx, unsigned int *maxy)
+static void route_quit()
 {
-  struct motor_message msg;
-  motor_status_get(&msg);
-  if (maxx)
-    *maxx = msg.x_max_steps;
-  if (maxy)
-    *maxy = msg.y_max_steps;
+    if (route.state == MOTOR_ROUTE_MOVING)
+        command_stop();
+    route_timer_set(0);
+    route.state = MOTOR_ROUTE_IDLE;
 }
 
-int motor_is_busy()
+/* a move from a client takes the motor over, the route waits to be resumed */
+static void route_preempt()
 {
-  struct motor_message msg;
-  motor_status_get(&msg);
-  return msg.status == MOTOR_IS_RUNNING ? 1 : 0;
+    if (route.state != MOTOR_ROUTE_MOVING && route.state != MOTOR_ROUTE_DWELL)
+        return;
+    TRACE(TRACE_ROUTE_PAUSED, route.kind, route.pos, 0, 0);
+    route_pause();
 }
 
-void motor_steps(int xsteps, int ysteps, int stepspeed) {
-  struct motors_steps steps;
+/*
+ * Run one request and queue its reply. Every request is answered exactly
+ * once: right away with the status code and any data it asks for, or for
+ * requests that wait on the motor by waiters_check() once it is idle.
+ * Anything that acts on the motor is handed to the control thread, status
+ * comes from its last snapshot, so no request ever blocks on the driver.
+ * Moves sent while the motor is homing run once it is done, or fail right
+ * away if the request asks for it with MOTOR_FLAG_NO_QUEUE. Moves, stops and
+ * resets from clients pause a running tour.
+ */
+void handle_request(struct client *cl, const struct motor_frame *hdr, struct request *req,
+                    const void *data, size_t data_len)
+{
+    uint32_t id = hdr->id;
+    struct motor_message motor_message;
+    struct motor_status_reply status_reply;
+    struct motor_preset preset, list[MOTOR_MAX_PRESETS];
+    int slot;
+    struct daemon_view view;
+    struct daemon_counters counters;
+    struct motor_route_status route_status;
+    struct motor_trace_info trace_info;
+    unsigned char metrics_buf[MAX_METRICS_SIZE];
+    const void *reply = NULL;
+    size_t reply_len = 0;
+    int status = MOTOR_OK;
+
+    TRACE(TRACE_REQUEST, id, req->command | req->type << 8, req->x, req->y);
+
+    if (req->speed != 0)
+        last_known_speed = req->speed;
+
+    switch(req->command){
+        case 'd': // move direction
+            switch(req->type){
+            case 's': // stop
+                route_preempt();
+                command_stop();
+            break;
+            case 'g': // relative movement
+            case 'h': // absolute movement
+            case 'v': // continuous velocity, x and y in steps/s
+            case 'k': // tracking target, filtered before it becomes a move
+            case 'b': // go back
+            case 'c': // cruise
+                route_preempt();
+                status = move_send(hdr, req);
+            break;
+            default:
+                status = MOTOR_ERR_TYPE;
+            break;
+            }
+            //move then wait, the reply comes once the move is done
+            if (status == MOTOR_OK && req->wait > 0) {
+                client_wait(cl, id, req->wait, true);
+                return;
+            }
+        break;
+        case 'r': //reset
+            route_preempt();
+            status = command_send(req);
+            //the reply comes once the driver is done with the sweep
+            if (status == MOTOR_OK) {
+                client_wait(cl, id, RESET_WAIT_MS, false);
+                return;
+            }
+        break;
+        case 'i': //get initial parameters
+            //This doesnt seem right, we are returning current information instead of initial parameters
+            //not correcting for now, as we want to have functional parity
+        case 'j': //get json
+        case 'e': //get json with the estimated position
+        case 'p': //get simple x y position
+        case 'b': //is busy
+        case 'S': //show status
+            daemon_status_reply(&status_reply, &view);
+            status_hits++;
+            reply = &status_reply;
+            reply_len = sizeof(struct motor_status_reply);
+        break;
+        case 's': //set speed
+            last_known_speed = req->speed; // Don't limit the speed
+            status = command_send(req);
+        break;
+        case 'I': // Invert motor direction, x, y or b for both
+            if (req->type == 'x' || req->type == 'y' || req->type == 'b') {
+                status = command_send(req);
+            } else {
+                status = MOTOR_ERR_TYPE;
+            }
+        break;
+        case 'u': //subscribe to status updates, x is the period in ms, 0 = on change
+            client_subscribe(cl, id, req->x);
+        break;
+        case 'P': //presets, picked by the struct motor_preset after the request
+            memset(&preset, 0, sizeof(preset));
+            memcpy(&preset, data, data_len < sizeof(preset) ? data_len : sizeof(preset));
+            preset.name[MOTOR_PRESET_NAME - 1] = '\0';
+            switch (req->type) {
+            case 's': // set, at x and y or where the motor is
+                daemon_status(&motor_message, &view);
+                status = preset_set(&preset, req->got_x ? req->x : motor_message.x,
+                                    req->got_y ? req->y : motor_message.y);
+            break;
+            case 'd': // delete
+                slot = preset_lookup(&preset);
+                if (slot < 0) {
+                    status = MOTOR_ERR_NOENT;
+                    break;
+                }
+                memset(&presets.slot[slot], 0, sizeof(struct motor_preset));
+                preset_index_rebuild();
+                presets_save();
+            break;
+            case 'l': // list, every used slot
+                for (slot = 0; slot < MOTOR_MAX_PRESETS; slot++)
+                    if (presets.slot[slot].id != 0)
+                        list[reply_len++] = presets.slot[slot];
+                reply = list;
+                reply_len *= sizeof(struct motor_preset);
+            break;
+            case 'g': // goto, an absolute move with the usual speed and wait
+                slot = preset_lookup(&preset);
+                if (slot < 0) {
+                    status = MOTOR_ERR_NOENT;
+                    break;
+                }
+                req->command = 'd';
+                req->type = 'h';
+                req->x = presets.slot[slot].x;
+                req->y = presets.slot[slot].y;
+                req->got_x = req->got_y = 1;
+                route_preempt();
+                status = move_send(hdr, req);
+                if (status == MOTOR_OK && req->wait > 0) {
+                    client_wait(cl, id, req->wait, true);
+                    return;
+                }
+            break;
+            default:
+                status = MOTOR_ERR_TYPE;
+            break;
+            }
+        break;
+        case 'T': //tours and scans, the waypoints or struct motor_scan follow the request, x = 1 loops
+            switch (req->type) {
+            case 's': // start a tour, replacing any route
+                status = route_start_tour(data, data_len, req->x != 0);
+            break;
+            case 'g': // start a grid scan, replacing any route
+                status = route_start_scan(data, data_len, req->speed, req->x != 0);
+            break;
+            case 'p': // pause
+                route_pause();
+            break;
+            case 'r': // resume at the point it was paused at
+                route_resume();
+            break;
+            case 'q': // quit
+                route_quit();
+            break;
+            case 'i': // info
+            break;
+            default:
+                status = MOTOR_ERR_TYPE;
+            break;
+            }
+            route_status_get(&route_status);
+            reply = &route_status;
+            reply_len = sizeof(struct motor_route_status);
+        break;
+        case 'M': //metrics, latency histograms and connection and queue figures
+            reply_len = metrics_get(metrics_buf);
+            reply = metrics_buf;
+        break;
+        case 'X': //trace, d dumps the ring to trace_path, f sets the categories traced to x
+            if (req->type == 'f')
+                atomic_store_explicit(&trace_mask, req->x & MOTOR_TRACE_ALL, memory_order_relaxed);
+            else if (req->type != 'd')
+                status = MOTOR_ERR_TYPE;
+            else if (trace_dump(0) == -1)
+                status = MOTOR_ERR_IO;
+            memset(&trace_info, 0, sizeof(trace_info));
+            trace_info.written = atomic_load_explicit(&trace_head, memory_order_relaxed);
+            trace_info.mask = atomic_load_explicit(&trace_mask, memory_order_relaxed);
+            strncpy(trace_info.path, trace_path, sizeof(trace_info.path) - 1);
+            reply = &trace_info;
+            reply_len = sizeof(trace_info);
+        break;
+        case 'w': //wait until idle
+            client_wait(cl, id, req->wait > 0 ? req->wait : WAIT_DEFAULT_MS, true);
+        return;
+        case 'C': //status cache and move counters
+            snapshot_read(&view);
+            counters = view.counters;
+            counters.hits += status_hits;
+            reply = &counters;
+            reply_len = sizeof(struct daemon_counters);
+        break;
+        default:
+            status = MOTOR_ERR_COMMAND;
+        break;
+    }
+    client_reply(cl, id, status, reply, reply_len);
+}
 
-  // Apply the correct inversion based on the motor_inversion_state
-  steps.x = (motor_inversion_state & MOTOR_INVERT_X) ? -xsteps : xsteps;
-  steps.y = (motor_inversion_state & MOTOR_INVERT_Y) ? -ysteps : ysteps;
+/*
+ * Run every complete frame in the input buffer, in order, for as long as
+ * there is room for its reply. A client that does not read its replies stops
+ * being served until it drains them, which gives pipelined sessions
+ * backpressure without buffering unbounded output. A frame that cannot be
+ * parsed leaves no way to find the next one, the client is answered if
+ * possible and dropped once its replies are out.
+ */
+static void client_process(struct client *cl)
+{
+    size_t off = 0;
+    while (!cl->waiting && cl->inlen - off >= sizeof(struct motor_frame) &&
+           CLIENT_OUT_SIZE - cl->outlen >= MAX_REPLY_SIZE) {
+        struct motor_frame hdr;
+        struct request req;
+        memcpy(&hdr, cl->inbuf + off, sizeof(hdr));
+
+        if (hdr.magic != MOTOR_PROTO_MAGIC || hdr.kind != MOTOR_FRAME_REQUEST ||
+            hdr.length > MOTOR_MAX_PAYLOAD) {
+            TRACE(TRACE_BAD_FRAME, cl->fd, 0, 0, 0);
+            if (hdr.magic == MOTOR_PROTO_MAGIC)
+                client_reply(cl, hdr.id, MOTOR_ERR_LENGTH, NULL, 0);
+            cl->eof = true;
+            off = cl->inlen;
+            break;
+        }
+        if (cl->inlen - off < sizeof(hdr) + hdr.length)
+            break;
+        off += sizeof(hdr) + hdr.length;
 
-  syslog(LOG_DEBUG,"Starting relative move");
-  syslog(LOG_DEBUG," -> steps, X %d, Y %d, speed %d\n", steps.x, steps.y, stepspeed);
-  motor_ioctl(MOTOR_SPEED, &stepspeed);
-  motor_ioctl(MOTOR_MOVE, &steps);
-  syslog(LOG_DEBUG,"Finished setting relative move");
+        if (hdr.version != MOTOR_PROTO_VERSION) {
+            client_reply(cl, hdr.id, MOTOR_ERR_VERSION, NULL, 0);
+            continue;
+        }
+        if (hdr.length < sizeof(struct request)) {
+            client_reply(cl, hdr.id, MOTOR_ERR_LENGTH, NULL, 0);
+            continue;
+        }
+        memcpy(&req, cl->inbuf + off - hdr.length, sizeof(struct request));
+        capture_request(cl, &hdr, cl->inbuf + off - hdr.length);
+        uint64_t started = now_us();
+        handle_request(cl, &hdr, &req, cl->inbuf + off - hdr.length + sizeof(struct request),
+                       hdr.length - sizeof(struct request));
+        histogram_add(&metrics.commands[metrics_slot(req.command)], now_us() - started);
+    }
+    if (off != 0) {
+        cl->inlen -= off;
+        memmove(cl->inbuf, cl->inbuf + off, cl->inlen);
+    }
 }
 
-void motor_set_position(int xpos, int ypos, int stepspeed) {
-  struct motor_message msg;
-  motor_status_get(&msg);
+/* returns -1 if the client had to be closed */
+static int client_service(struct client *cl)
+{
+    for (;;) {
+        client_process(cl);
+        if (cl->outpos == cl->outlen)
+            break;
+        uint64_t started = now_us();
+        ssize_t n = send(cl->fd, cl->outbuf + cl->outpos, cl->outlen - cl->outpos, MSG_NOSIGNAL);
+        histogram_add(&metrics.socket_write, now_us() - started);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            client_close(cl);
+            return -1;
+        }
+        cl->outpos += n;
+        cl->last_active = now_ms();
+        if (cl->outpos == cl->outlen) {
+            cl->outpos = 0;
+            cl->outlen = 0;
+        }
+    }
 
-  int deltax = xpos - msg.x;
-  int deltay = ypos - msg.y;
+    if (cl->eof && cl->outlen == 0 && !cl->waiting) {
+        client_close(cl);
+        return -1;
+    }
 
-  // Apply inversion to deltas based on the inversion state
-  if (motor_inversion_state & MOTOR_INVERT_X) {
-      deltax = -deltax;
-  }
-  if (motor_inversion_state & MOTOR_INVERT_Y) {
-      deltay = -deltay;
-  }
+    uint32_t events = 0;
+    if (!cl->eof && cl->inlen < CLIENT_IN_SIZE)
+        events |= EPOLLIN;
+    if (cl->outlen != 0)
+        events |= EPOLLOUT;
+    client_watch(cl, events);
+    return 0;
+}
 
-  syslog(LOG_DEBUG,"Starting absolute move");
-  syslog(LOG_DEBUG," -> set position current X: %d, Y: %d, steps required X: %d, Y: %d, speed %d\n", msg.x, msg.y, deltax, deltay, stepspeed);
-  motor_steps(deltax, deltay, stepspeed); 
-  syslog(LOG_DEBUG,"Finished setting absolute move");
+static void client_read(struct client *cl)
+{
+    while (cl->inlen < CLIENT_IN_SIZE) {
+        uint64_t started = now_us();
+        ssize_t n = read(cl->fd, cl->inbuf + cl->inlen, CLIENT_IN_SIZE - cl->inlen);
+        histogram_add(&metrics.socket_read, now_us() - started);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            TRACE(TRACE_READ_ERROR, cl->fd, errno, 0, 0);
+            client_close(cl);
+            return;
+        }
+        if (n == 0) {
+            cl->eof = true;
+            break;
+        }
+        cl->inlen += n;
+        cl->last_active = now_ms();
+    }
+    client_service(cl);
 }
 
-int check_pid(char *file_name)
+static void status_timer_tick()
 {
-    FILE *f;
-    long pid;
-    char pid_buffer[PID_SIZE];
+    uint64_t expirations;
+    struct motor_message msg;
 
-    f = fopen(file_name, "r");
-    if(f == NULL)
-        return 0;
+    if (read(status_timerfd, &expirations, sizeof(expirations)) == -1)
+        return;
+    motor_status_fresh(&msg);
+}
 
-    if (fgets(pid_buffer, PID_SIZE, f) == NULL) {
-        fclose(f);
-        return 0;
-    }
-    fclose(f);
+static void control_timer_tick()
+{
+    uint64_t expirations;
 
-    if (sscanf(pid_buffer, "%ld", &pid) != 1) {
-        return 0;
-    }
+    if (read(control_timerfd, &expirations, sizeof(expirations)) == -1)
+        return;
+    plan_tick();
+}
 
-    if (kill(pid, 0) == 0) {
-        return 1;
-    }
+static void flush_timer_tick()
+{
+    uint64_t expirations;
 
-    return 0;
+    if (read(flush_timerfd, &expirations, sizeof(expirations)) == -1)
+        return;
+    move_flush();
 }
 
-int create_pid(char *file_name)
+/*
+ * The control thread owns the motor device, the planner and every timer
+ * that drives it. It only sleeps in epoll_wait or in a driver ioctl and
+ * tells the I/O thread what happened through the snapshot.
+ */
+static void *control_run(void *arg)
 {
-    FILE *f;
-    char pid_buffer[PID_SIZE];
+    struct epoll_event events[MAX_EVENTS];
+    struct motor_message msg;
+    int i;
+
+    (void) arg;
+    for (;;) {
+        int nevents = epoll_wait(control_epollfd, events, MAX_EVENTS, -1);
+        if (nevents == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR,"control epoll_wait failed, errno : %i, exiting", errno);
+            exit(EXIT_FAILURE);
+        }
 
-    f = fopen(file_name, "w");
-    if (f == NULL)
-        return -1;
+        for (i = 0; i < nevents; i++) {
+            if (events[i].data.ptr == &command_eventfd)
+                command_drain();
+            else if (events[i].data.ptr == &status_timerfd)
+                status_timer_tick();
+            else if (events[i].data.ptr == &control_timerfd)
+                control_timer_tick();
+            else if (events[i].data.ptr == &flush_timerfd)
+                flush_timer_tick();
+        }
 
-    memset(pid_buffer, '\0', PID_SIZE);
-    sprintf(pid_buffer, "%ld\n", (long) getpid());
-    if (fwrite(pid_buffer, strlen(pid_buffer), 1, f) != 1) {
-        fclose(f);
-        return -2;
+        //everything that arrived in this round is merged into at most one move
+        move_flush();
+        if (!status_cache.valid)
+            motor_status_fresh(&msg);
+        if (!move_request.pending && !piece_running && !velocity.active && !homing &&
+            status_cache.msg.status == MOTOR_IS_STOP)
+            journal_update(false);
+        snapshot_publish();
     }
-    fclose(f);
-
-    return 0;
+    return NULL;
 }
 
-static void daemonsetup()
+/* add fd to an epoll set, tagged with the address of its global */
+static void epoll_watch(int efd, int *fdp)
 {
-    pid_t pid;
+    struct epoll_event ev;
 
-    /* Fork off the parent process */
-    pid = fork();
+    if (*fdp == -1)
+        return;
+    ev.events = EPOLLIN;
+    ev.data.ptr = fdp;
+    epoll_ctl(efd, EPOLL_CTL_ADD, *fdp, &ev);
+}
 
-    /* An error occurred */
-    if (pid < 0)
-        exit(EXIT_FAILURE);
+static void server_accept(int serverfd)
+{
+    for (;;) {
+        int clientfd = accept4(serverfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                TRACE(TRACE_ACCEPT_ERROR, errno, 0, 0, 0);
+            return;
+        }
 
-    /* Success: Let the parent terminate */
-    if (pid > 0)
-        exit(EXIT_SUCCESS);
+        struct client *cl = client_alloc(clientfd);
+        if (cl == NULL) {
+            syslog(LOG_INFO,"Too many clients, refusing connection");
+            close(clientfd);
+            continue;
+        }
 
-    /* On success: The child process becomes session leader */
-    if (setsid() < 0)
-        exit(EXIT_FAILURE);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = cl;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, clientfd, &ev) == -1) {
+            close(clientfd);
+            cl->fd = -1;
+            nclients--;
+            continue;
+        }
+        cl->events = EPOLLIN;
+        cl->serial = ++clients_accepted;
+        metrics.accepted++;
+        if ((uint32_t) nclients > metrics.connections_peak)
+            metrics.connections_peak = nclients;
+        TRACE(TRACE_ACCEPT, clientfd, nclients, 0, 0);
+    }
+}
 
-    /* Catch, ignore and handle signals */
-    //TODO: Implement a working signal handler */
-    signal(SIGCHLD, SIG_IGN);
-    signal(SIGHUP, SIG_IGN);
+/*
+ * The snapshot is read once per round for all subscribers and pushed to each
+ * one that is due: periodic ones when their period has passed, the others
+ * when it differs from what they saw last. A subscriber that does not keep
+ * up with its updates skips them rather than holding up the others.
+ */
+static void subscribers_tick()
+{
+    struct motor_status_reply status;
+    struct daemon_view view;
+    long long now = now_ms();
+    int i;
+
+    if (nsubscribers == 0)
+        return;
+    daemon_status_reply(&status, &view);
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        struct client *cl = &clients[i];
+        if (cl->fd == -1 || !cl->subscribed || cl->waiting)
+            continue;
+        if (cl->sub_interval_ms != 0) {
+            if (now < cl->sub_next)
+                continue;
+            cl->sub_next = now + cl->sub_interval_ms;
+        } else if (memcmp(&cl->sub_last, &status.msg, sizeof(struct motor_message)) == 0) {
+            continue;
+        }
+        if (CLIENT_OUT_SIZE - cl->outlen < 2 * MAX_REPLY_SIZE)
+            continue;
+        cl->sub_last = status.msg;
+        client_frame(cl, MOTOR_FRAME_EVENT, cl->sub_id, MOTOR_OK, MOTOR_EVENT_STATUS, &status, sizeof(status));
+        client_service(cl);
+    }
+}
 
-    /* Fork off for the second time*/
-    pid = fork();
+/*
+ * Tell every subscriber a route reached a point. Unlike status updates an
+ * arrival is not skipped for a slow subscriber as long as its buffer has
+ * room, a capture process relies on seeing each one.
+ */
+static void route_arrived(const struct motor_arrival *arrival)
+{
+    int i;
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        struct client *cl = &clients[i];
+        if (cl->fd == -1 || !cl->subscribed)
+            continue;
+        client_frame(cl, MOTOR_FRAME_EVENT, cl->sub_id, MOTOR_OK, MOTOR_EVENT_ARRIVED, arrival, sizeof(struct motor_arrival));
+        client_service(cl);
+    }
+}
 
-    /* An error occurred */
-    if (pid < 0)
-        exit(EXIT_FAILURE);
+/*
+ * A point is reached once the control thread is done with the move there and
+ * the motor is idle, the same test a waiting client is released on. The
+ * dwell runs from then on. Subscribers are told last, serving them may run
+ * their requests and change the route.
+ */
+static void route_check()
+{
+    struct daemon_view view;
+    struct motor_arrival arrival;
+
+    if (route.state != MOTOR_ROUTE_MOVING)
+        return;
+    snapshot_read(&view);
+    if (seq_before(view.done, route.move_seq) || view.busy)
+        return;
+    route.state = MOTOR_ROUTE_DWELL;
+    route_status_get(&arrival.route);
+    arrival.x = view.msg.x;
+    arrival.y = view.msg.y;
+    if (route.points[route.pos].dwell_ms > 0)
+        route_timer_set(route.points[route.pos].dwell_ms);
+    else
+        route_next();
+    if (nsubscribers != 0)
+        route_arrived(&arrival);
+}
 
-    /* Success: Let the parent terminate */
-    if (pid > 0)
-        exit(EXIT_SUCCESS);
+static void route_timer_tick()
+{
+    uint64_t expirations;
 
-    /* Set new file permissions */
-    umask(0);
+    if (read(route_timerfd, &expirations, sizeof(expirations)) == -1)
+        return;
+    if (route.state == MOTOR_ROUTE_DWELL)
+        route_next();
+}
 
-    /* Change the working directory */
-    chdir("/dev/");
+/*
+ * A parked client is released once the control thread has taken every
+ * command it sent before waiting and, unless it only waits for those, the
+ * daemon is idle: nothing queued, no piece running and the driver reports
+ * the motor stopped. Every parked client gets the status in one go when
+ * that happens, or on its own once its timeout runs out.
+ */
+static void waiters_check()
+{
+    struct motor_status_reply status;
+    struct daemon_view view;
+    long long now = now_ms();
+    int i;
+
+    if (nwaiters == 0)
+        return;
+    daemon_status_reply(&status, &view);
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        struct client *cl = &clients[i];
+        if (cl->fd == -1 || !cl->waiting)
+            continue;
+        bool ready = !seq_before(view.done, cl->wait_seq) && !(cl->wait_idle && view.busy);
+        if (!ready && now < cl->wait_deadline)
+            continue;
+        cl->waiting = false;
+        nwaiters--;
+        client_reply(cl, cl->wait_id, ready ? MOTOR_OK : MOTOR_ERR_TIMEOUT,
+                     &status, sizeof(status));
+        client_service(cl);
+    }
+}
 
-    /* Close all open file descriptors */
-    int x;
-    for (x = sysconf(_SC_OPEN_MAX); x>=0; x--)
-    {
-        close (x);
+/* epoll timeout that still lets waiters time out and periodic subscribers fire on time */
+static int loop_timeout()
+{
+    long long now = now_ms();
+    long long timeout = nclients ? 1000 : -1;
+    int i;
+
+    for (i = 0; i < MAX_CLIENTS && (nwaiters != 0 || nsubscribers != 0); i++) {
+        long long left;
+        if (clients[i].fd == -1)
+            continue;
+        if (clients[i].waiting)
+            left = clients[i].wait_deadline - now;
+        else if (clients[i].subscribed && clients[i].sub_interval_ms != 0)
+            left = clients[i].sub_next - now;
+        else
+            continue;
+        if (left < 0)
+            left = 0;
+        if (timeout == -1 || left < timeout)
+            timeout = left;
+    }
+    if (capture_fd != -1 && (capture_len != 0 || capture_moving)) {
+        long long left = capture_due > now ? capture_due - now : 0;
+        if (timeout == -1 || left < timeout)
+            timeout = left;
     }
+    return timeout;
+}
 
-    /* Open the log file */
-    openlog ("motors-daemon", LOG_PID, LOG_DAEMON);
+/*
+ * Drop clients that hold a slot without making progress. Sessions that sit
+ * idle between requests are kept much longer than ones stuck mid-exchange.
+ */
+static void client_expire()
+{
+    long long now = now_ms();
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd == -1)
+            continue;
+        if (clients[i].waiting)
+            continue;
+        bool stalled = clients[i].inlen != 0 || clients[i].outlen != 0;
+        if (clients[i].subscribed && !stalled)
+            continue;
+        if (now - clients[i].last_active > (stalled ? CLIENT_TIMEOUT_MS : CLIENT_IDLE_TIMEOUT_MS)) {
+            TRACE(TRACE_TIMEOUT, clients[i].fd, 0, 0, 0);
+            client_close(&clients[i]);
+        }
+    }
 }
 
-void requestcleanup(){
-    //
-    request_message.command = 'd';
-    request_message.type = 's';
-    request_message.x = 0;
-    request_message.got_x = 0;
-    request_message.y = 0;
-    request_message.got_y = 0;
-    request_message.speed = 0;  // Reset speed in request
+/* "X,Y" sets both axes, a single value applies to both */
+static void parse_axis_pair(const char *arg, int *x, int *y)
+{
+    const char *comma = strchr(arg, ',');
+    *x = atoi(arg);
+    *y = comma ? atoi(comma + 1) : *x;
 }
 
 int main(int argc, char *argv[])
@@ -285,21 +2983,116 @@ int main(int argc, char *argv[])
     int c;
     char *pid_file;
     bool skip_reset = false; // Initialize skip_reset to false
+    bool decel_set = false;
+    long mask;
+    started_ms = now_ms();
+    trace_started_us = now_us();
     pid_file = "/var/run/motors-daemon";
-    //setlogmask(LOG_UPTO(LOG_DEBUG));
-    while ((c = getopt(argc, argv, "dhp")) != -1){
+    setlogmask(LOG_UPTO(LOG_INFO));
+    backend = &kernel_backend;
+    while ((c = getopt(argc, argv, "dhpt:a:A:v:l:T:D:J:P:k:e:m:s:f:X:R:")) != -1){
         switch(c){
             case 'd':
-           // setlogmask(LOG_UPTO(LOG_DEBUG));
+            setlogmask(LOG_UPTO(LOG_DEBUG));
             break;
             case 'p':
             skip_reset = true; // Set skip_reset to true if -p is provided
             break;
+            case 't':
+            status_refresh_ms = atoi(optarg);
+            break;
+            case 'a':
+            parse_axis_pair(optarg, &planner_config.x.accel, &planner_config.y.accel);
+            // deceleration follows acceleration unless set on its own
+            if (!decel_set) {
+                planner_config.x.decel = planner_config.x.accel;
+                planner_config.y.decel = planner_config.y.accel;
+            }
+            break;
+            case 'A':
+            parse_axis_pair(optarg, &planner_config.x.decel, &planner_config.y.decel);
+            decel_set = true;
+            break;
+            case 'v':
+            planner_config.start_speed = atoi(optarg);
+            break;
+            case 'l':
+            planner_config.interp_steps = atoi(optarg);
+            break;
+            case 'T':
+            coalesce_ms = atoi(optarg);
+            break;
+            case 'D':
+            velocity_deadman_ms = atoi(optarg);
+            break;
+            case 'J':
+            journal_path = optarg;
+            break;
+            case 'P':
+            preset_path = optarg;
+            break;
+            case 'k':
+            track_alpha = strtod(optarg, NULL);
+            if (strchr(optarg, ','))
+                track_beta = strtod(strchr(optarg, ',') + 1, NULL);
+            break;
+            case 'e':
+            track_deadband = atoi(optarg);
+            break;
+            case 'm':
+            track_slew = atoi(optarg);
+            break;
+            case 's':
+            {
+                int sx = 0, sy = 0, sms = 0;
+                if (sscanf(optarg, "%d,%d,%d", &sx, &sy, &sms) < 2 || sx <= 0 || sy <= 0) {
+                    printf("Invalid simulated motor range %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                motor_sim_init(&motor_sim, sx, sy, sms);
+                backend = &sim_backend;
+            }
+            break;
+            case 'f':
+            mask = motor_trace_parse_mask(optarg);
+            if (mask < 0) {
+                printf("Invalid trace categories %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            atomic_store(&trace_mask, mask);
+            break;
+            case 'X':
+            if (strlen(optarg) >= MOTOR_TRACE_PATH_SIZE) {
+                printf("Trace path %s too long\n", optarg);
+                return EXIT_FAILURE;
+            }
+            trace_path = optarg;
+            break;
+            case 'R':
+            capture_path = optarg;
+            break;
             default:
                 printf("Usage : \n"
                        "\t -d enable debugging messages to syslog\n"
                        "\t -h print this help message\n"
                        "\t -p skip reset position on launch\n"
+                       "\t -t status refresh interval in ms while the motor runs (default 100)\n"
+                       "\t -a X[,Y] acceleration in steps/s^2 per axis, ramps moves up to speed (default 0, off)\n"
+                       "\t -A X[,Y] deceleration in steps/s^2 per axis (default same as -a)\n"
+                       "\t -v start speed for ramped moves (default 100)\n"
+                       "\t -l N coordinated X/Y moves in sub-moves of at most N steps (default 0, off)\n"
+                       "\t -T control tick in ms, move requests within a tick are merged (default 50)\n"
+                       "\t -D velocity mode deadman timeout in ms (default 500)\n"
+                       "\t -J path of the position journal used to skip homing on restart (default " MOTOR_JOURNAL_PATH ")\n"
+                       "\t -P path of the preset table (default " PRESET_PATH ")\n"
+                       "\t -k ALPHA[,BETA] tracking filter gains on position and rate (default 0.5,0.1)\n"
+                       "\t -e N tracking deadband in steps (default 8)\n"
+                       "\t -m N tracking slew limit in steps/s (default 0, off)\n"
+                       "\t -s X,Y[,MS] drive a simulated motor of X by Y steps instead of /dev/motor,\n"
+                       "\t    homing in MS ms (default the time the sweep takes at the set speed)\n"
+                       "\t -f LIST trace categories recorded, request,client,control,ioctl,route, all or none (default all)\n"
+                       "\t -X path the trace is dumped to on request, SIGUSR1 or a crash (default " MOTOR_TRACE_PATH ")\n"
+                       "\t -R path capture every request with its timing for motor-replay\n"
                        "\t No option to start the daemon\n");
             return EXIT_FAILURE;
             break;
@@ -307,6 +3100,7 @@ int main(int argc, char *argv[])
 
     }
     daemonsetup();
+    trace_handlers();
     if (check_pid(pid_file) == 1) {
         syslog(LOG_INFO,"Motors daemon is already running.");
         printf("Motors daemon is already running\n");
@@ -317,21 +3111,15 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
     int daemonstop = 0;
-    int closeready = 0;
+    int i;
     //struct instances
     struct sockaddr_un addr; //socket struct
-    struct motor_reset_data motor_reset_data;
     struct motor_message motor_message;
+    struct epoll_event ev, events[MAX_EVENTS];
 
     //acquire control of motor device
-    motorfd = open("/dev/motor", 0);
-
-    //reset motor as setup if not skipping reset
-    if (!skip_reset) {
-        syslog(LOG_DEBUG,"== Reset position, please wait");
-        memset(&motor_reset_data, 0, sizeof(motor_reset_data));
-        ioctl(motorfd, MOTOR_RESET, &motor_reset_data);
-    }
+    if (backend->open() == -1)
+        syslog(LOG_ERR, "Could not open the %s motor, errno : %i", backend->name, errno);
 
     int serverfd = socket(AF_UNIX, SOCK_STREAM, 0);
     syslog(LOG_DEBUG,"Server socket fd = %d", serverfd);
@@ -364,145 +3152,120 @@ int main(int argc, char *argv[])
         closelog();
         exit(EXIT_FAILURE);
     }
+    set_nonblocking(serverfd);
+
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd == -1) {
+        syslog(LOG_ERR,"Error creating epoll instance, exiting");
+        closelog();
+        exit(EXIT_FAILURE);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, serverfd, &ev);
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+
+    status_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_watch(epollfd, &status_eventfd);
+    route_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epoll_watch(epollfd, &route_timerfd);
+
+    //the control thread sleeps on its own set: commands and the motor timers
+    control_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    command_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    status_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    control_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    flush_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (control_epollfd == -1 || command_eventfd == -1 || status_eventfd == -1) {
+        syslog(LOG_ERR,"Error creating the control thread events, exiting");
+        closelog();
+        exit(EXIT_FAILURE);
+    }
+    epoll_watch(control_epollfd, &command_eventfd);
+    epoll_watch(control_epollfd, &status_timerfd);
+    epoll_watch(control_epollfd, &control_timerfd);
+    epoll_watch(control_epollfd, &flush_timerfd);
+
+    //publish the initial status for shared memory readers
+    status_shm_setup();
+    motor_status_fresh(&motor_message);
+    journal_setup();
+    presets_load();
+    capture_setup();
+
+    //home in the background, clients are served meanwhile and see MOTOR_IS_HOMING
+    if (!skip_reset && journal_restore()) {
+        homed_ms = now_ms() - started_ms;
+    } else if (!skip_reset) {
+        struct request reset_request = { .command = 'r' };
+        syslog(LOG_DEBUG,"== Reset position in the background");
+        command_send(&reset_request);
+    } else {
+        homed_ms = now_ms() - started_ms;
+    }
+
+    ready_ms = now_ms() - started_ms;
+    syslog(LOG_INFO, "Accepting connections %u ms after start, %lld ms after boot", ready_ms, boot_ms());
+    snapshot_publish();
+
+    pthread_t control_thread;
+    if (pthread_create(&control_thread, NULL, control_run, NULL) != 0) {
+        syslog(LOG_ERR,"Error starting the control thread, exiting");
+        closelog();
+        exit(EXIT_FAILURE);
+    }
 
     syslog (LOG_INFO, "motors-daemon started");
 
     while (daemonstop == 0)
     {   
-        //make request object go back to initial value
-        syslog(LOG_DEBUG,"Start request cleanup");
-        requestcleanup();
-        //reset ok to close fd flag
-        int closeready = 0;
-        syslog(LOG_DEBUG,"Waiting to accept a connection");
-        //blocking code, wait for a connection
-        int clientfd = accept(serverfd, NULL, NULL);
-        if(clientfd == -1){
-            syslog(LOG_DEBUG,"clientfd is invalid after connection accept, socket doesnt work and is %i errno : %i",clientfd,errno);
-            syslog(LOG_DEBUG,"exiting...");
+        int nevents = epoll_wait(epollfd, events, MAX_EVENTS, loop_timeout());
+        if (nevents == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR,"epoll_wait failed, errno : %i, exiting", errno);
             exit(EXIT_FAILURE);
         }
-        syslog(LOG_DEBUG,"Accepting a connection\n");
-
-        //load the message onto the reques_message struct
-        if(read(clientfd,&request_message,sizeof(struct request)) == -1){
-            syslog(LOG_DEBUG,"Could not read message from motors app, ignore request");
-            syslog(LOG_DEBUG,"client fd at this point is %i errno : %i",clientfd,errno);
-        }
-        else{
-            syslog (LOG_DEBUG, "request command is %c",request_message.command);
 
-            if (request_message.speed != 0) {
-                last_known_speed = request_message.speed;
-                syslog(LOG_DEBUG, "Updating last known speed to %d", last_known_speed);
-            } else {
-                syslog(LOG_DEBUG, "Using last known speed %d", last_known_speed);
+        for (i = 0; i < nevents; i++) {
+            struct client *cl = events[i].data.ptr;
+            if (cl == NULL) {
+                server_accept(serverfd);
+                continue;
             }
-
-            switch(request_message.command){
-                case 'd': // move direction
-                    syslog (LOG_DEBUG, "request type is %c",request_message.type);
-                    switch(request_message.type){
-                    case 'g': //relative movement
-                        motor_steps(request_message.x, request_message.y, last_known_speed);
-                        syslog (LOG_DEBUG, "request x is %i",request_message.x);
-                        syslog (LOG_DEBUG, "request y is %i",request_message.y);
-                        break;
-                    case 'h': // absolute movement
-                            motor_status_get(&motor_message);
-                            if (request_message.got_x == 0)
-                              request_message.x = motor_message.x; //as we are rewriting initial between requests this should not be necessary but leaving as is as to not break anything
-                            if (request_message.got_y == 0)
-                              request_message.y = motor_message.y;
-                            motor_set_position(request_message.x, request_message.y, last_known_speed);
-                            syslog (LOG_DEBUG, "request x is %i",request_message.x);
-                            syslog (LOG_DEBUG, "request y is %i",request_message.y);
-                        break;
-                    case 'b': // go back
-                        motor_ioctl(MOTOR_GOBACK, NULL);//should we block until "go back" movement is finished?
-                    break;
-                    case 'c': // cruise
-                        motor_ioctl(MOTOR_CRUISE, NULL);
-                    break;
-                    case 's': // stop
-                        motor_ioctl(MOTOR_STOP, NULL);
-                    break;
-
-                    }
-                break;
-                case 'r': //reset
-                    syslog (LOG_DEBUG, "== Reset position, please wait");
-                    //cleanup of reset data before reset, is necesary otherwise reset is never performed even though it never fails
-                    memset(&motor_reset_data, 0, sizeof(motor_reset_data));
-                    ioctl(motorfd, MOTOR_RESET, &motor_reset_data);
-                break;
-                case 'i': //get initial parameters
-                    //This doesnt seem right, we are returning current information instead of initial parameters
-                    //not correcting for now, as we want to have functional parity
-                    motor_status_get(&motor_message);
-                    syslog (LOG_DEBUG, "Got current status to load into command");
-                    write(clientfd,&motor_message,sizeof(struct motor_message));
-                break;
-                case 'j': //get json
-                    motor_status_get(&motor_message);
-                    syslog (LOG_DEBUG, "Got current status to load into command");
-                    write(clientfd,&motor_message,sizeof(struct motor_message));
-                break;
-                case 'p': //get simple x y position 
-                    motor_status_get(&motor_message);
-                    syslog (LOG_DEBUG, "Got current status to load into command");
-                    write(clientfd,&motor_message,sizeof(struct motor_message));
-
-                break;
-                case 'b': //is busy
-                    motor_status_get(&motor_message);
-                    syslog (LOG_DEBUG, "Got current status to load into command");
-                    write(clientfd,&motor_message,sizeof(struct motor_message));
-
-                break;
-                case 's': //set speed
-                    last_known_speed = request_message.speed; // Don't limit the speed
-                    motor_ioctl(MOTOR_SPEED, &last_known_speed);
-                    syslog(LOG_DEBUG, "Set speed command, last known speed now %d", last_known_speed);
-                break;
-                case 'I': // Invert motor direction
-                    switch (request_message.type) {
-                        case 'x': // Invert X only
-                            motor_inversion_state ^= MOTOR_INVERT_X;
-                            syslog(LOG_DEBUG, "Motor inversion X set to %s", (motor_inversion_state & MOTOR_INVERT_X) ? "ON" : "OFF");
-                            break;
-                        case 'y': // Invert Y only
-                            motor_inversion_state ^= MOTOR_INVERT_Y;
-                            syslog(LOG_DEBUG, "Motor inversion Y set to %s", (motor_inversion_state & MOTOR_INVERT_Y) ? "ON" : "OFF");
-                            break;
-                        case 'b': // Invert both X and Y
-                            motor_inversion_state ^= MOTOR_INVERT_BOTH;
-                            syslog(LOG_DEBUG, "Motor inversion set to %s", (motor_inversion_state == MOTOR_INVERT_BOTH) ? "BOTH ON" : "BOTH OFF");
-                            break;
-                        default:
-                            syslog(LOG_DEBUG, "Invalid inversion command type.");
-                            break;
-                    }
-                break;
-                case 'S': //show status
-                    motor_status_get(&motor_message);
-                    motor_message.inversion_state = motor_inversion_state;
-                    write(clientfd,&motor_message,sizeof(struct motor_message));
-                    syslog(LOG_DEBUG, "Sent motor status");
-                break;
+            if (events[i].data.ptr == &status_eventfd) {
+                eventfd_clear(status_eventfd);
+                continue;
             }
-
-            //need to close fd after each request is completed
-            close(clientfd); 
+            if (events[i].data.ptr == &route_timerfd) {
+                route_timer_tick();
+                continue;
+            }
+            if (cl->fd == -1)
+                continue;
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                client_close(cl);
+                continue;
+            }
+            if (events[i].events & EPOLLIN)
+                client_read(cl);
+            else if (events[i].events & EPOLLOUT)
+                client_service(cl);
         }
-       
-        syslog (LOG_DEBUG, "====================");
 
-        //break;
+        route_check();
+        waiters_check();
+        subscribers_tick();
+        client_expire();
+        capture_tick();
     }
+    capture_flush();
 
     syslog (LOG_INFO, "motors-daemon terminated.");
     unlink(pid_file);
+    unlink(MOTOR_SHM_PATH);
     closelog();
 
     return EXIT_SUCCESS;
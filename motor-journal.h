@@ -0,0 +1,108 @@
+#ifndef MOTOR_JOURNAL_H
+#define MOTOR_JOURNAL_H
+
+/*
+ * Position journal kept by motors-daemon so a restart can skip the homing
+ * sweep.
+ *
+ * The journal is a small mmap'ed file holding two copies of the record. Each
+ * update goes into the slot that does not hold the newest record, with a
+ * higher seq and a checksum over the whole record, so a write cut short by a
+ * crash only ever spoils the older copy. The record says whether the motor
+ * may be moving: it is marked moving before anything is handed to the driver
+ * and only marked stopped once the driver reports it stopped, so a stopped
+ * record always holds the real position.
+ *
+ * On tmpfs an update costs a few stores into the page cache and survives the
+ * daemon or the kernel module going away, while a reboot, which needs a
+ * sweep anyway, starts without a journal.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MOTOR_JOURNAL_PATH "/dev/shm/motors-journal"
+#define MOTOR_JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+#define MOTOR_JOURNAL_VERSION 1
+
+struct motor_journal_record
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;                 // higher is newer
+  uint32_t moving;              // the motor may be away from x, y
+  int32_t x;                    // last position the motor was seen stopped at
+  int32_t y;
+  int32_t target_x;             // last position it was sent to
+  int32_t target_y;
+  uint32_t x_max_steps;
+  uint32_t y_max_steps;
+  uint32_t inversion_state;
+  uint32_t crc;                 // over everything above
+};
+
+struct motor_journal
+{
+  struct motor_journal_record slot[2];
+};
+
+/* CRC-32 (IEEE), bitwise, the record is too small to need a table */
+static inline uint32_t motor_journal_crc(const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  uint32_t crc = 0xffffffff;
+  int k;
+
+  while (len--) {
+    crc ^= *p++;
+    for (k = 0; k < 8; k++)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+static inline bool motor_journal_valid(const struct motor_journal_record *rec)
+{
+  return rec->magic == MOTOR_JOURNAL_MAGIC && rec->version == MOTOR_JOURNAL_VERSION &&
+         rec->crc == motor_journal_crc(rec, offsetof(struct motor_journal_record, crc));
+}
+
+/* newest consistent record, NULL if neither slot holds one */
+static inline const struct motor_journal_record *motor_journal_latest(const struct motor_journal *journal)
+{
+  const struct motor_journal_record *a = &journal->slot[0], *b = &journal->slot[1];
+  bool va = motor_journal_valid(a), vb = motor_journal_valid(b);
+
+  if (va && vb)
+    return (int32_t) (a->seq - b->seq) > 0 ? a : b;
+  if (va)
+    return a;
+  if (vb)
+    return b;
+  return NULL;
+}
+
+/* the two records describe the same state, seq and crc aside */
+static inline bool motor_journal_same(const struct motor_journal_record *a, const struct motor_journal_record *b)
+{
+  size_t from = offsetof(struct motor_journal_record, moving);
+  size_t to = offsetof(struct motor_journal_record, crc);
+  return memcmp((const char *) a + from, (const char *) b + from, to - from) == 0;
+}
+
+/* store rec as the newest record, over the older slot */
+static inline void motor_journal_write(struct motor_journal *journal, struct motor_journal_record *rec)
+{
+  const struct motor_journal_record *latest = motor_journal_latest(journal);
+  struct motor_journal_record *slot = &journal->slot[latest == &journal->slot[0] ? 1 : 0];
+
+  rec->magic = MOTOR_JOURNAL_MAGIC;
+  rec->version = MOTOR_JOURNAL_VERSION;
+  rec->seq = latest ? latest->seq + 1 : 1;
+  rec->crc = motor_journal_crc(rec, offsetof(struct motor_journal_record, crc));
+  memcpy(slot, rec, sizeof(struct motor_journal_record));
+}
+
+#endif
@@ -0,0 +1,322 @@
+#ifndef MOTOR_PLANNER_H
+#define MOTOR_PLANNER_H
+
+/*
+ * Motion planner for motors-daemon.
+ *
+ * A move is turned into a short list of constant speed segments that start at
+ * a safe start speed, step up to the requested speed, cruise, and step back
+ * down before the target. The kernel driver runs both axes at a single step
+ * rate, so the profile is planned along the longer axis and limited by the
+ * lowest acceleration among the axes that actually move.
+ *
+ * With interpolation on, both axes are spread evenly over the whole move and
+ * every segment is cut into sub-moves of at most interp_steps steps, so the
+ * two axes advance together along a straight line and arrive at the same
+ * time instead of the shorter one finishing first.
+ *
+ * The daemon hands a piece to the driver only once the driver reports the
+ * one before it stopped, so every piece ends in a stop and costs up to
+ * PLAN_POLL_MS and a status read on top of its run time. A sub-move of
+ * interp_steps at speed should take much longer than that: at 900 steps/s
+ * 100 steps take 111 ms and the stops add a few percent to the move, while
+ * much shorter sub-moves make the motion jerky and slow.
+ *
+ * Grid scans are ordered here as well, as a serpentine through the grid's
+ * points.
+ *
+ * Speeds are the driver's MOTOR_SPEED units (steps per second), accelerations
+ * are steps per second squared. This file is pure arithmetic without any I/O,
+ * so the planner can be exercised off the camera, see motor-test.c.
+ */
+
+#include <stdbool.h>
+
+#define PLANNER_MAX_SEGMENTS 32
+#define PLANNER_RAMP_STEPS 4     // speed levels on each ramp
+
+struct planner_axis
+{
+  int accel;    // 0 = no limit
+  int decel;    // 0 = no limit
+};
+
+struct planner_config
+{
+  struct planner_axis x;
+  struct planner_axis y;
+  int start_speed;   // speed the motor can start and stop at without ramping
+  int interp_steps;  // longest sub-move of a coordinated move, 0 = off, see above for its cost
+};
+
+/* one relative move handed to the driver at one speed */
+struct motor_segment
+{
+  int x;
+  int y;
+  int speed;
+};
+
+static inline int planner_abs(int v)
+{
+  return v < 0 ? -v : v;
+}
+
+/* lowest limit among the axes that move, 0 if none of them is limited */
+static inline int planner_limit(int lx, bool movx, int ly, bool movy)
+{
+  int limit = 0;
+  if (movx && lx > 0)
+    limit = lx;
+  if (movy && ly > 0 && (limit == 0 || ly < limit))
+    limit = ly;
+  return limit;
+}
+
+static inline long long planner_isqrt(long long v)
+{
+  long long r = 0, bit = 1LL << 62;
+  if (v <= 0)
+    return 0;
+  while (bit > v)
+    bit >>= 2;
+  while (bit != 0) {
+    if (v >= r + bit) {
+      v -= r + bit;
+      r = (r >> 1) + bit;
+    } else {
+      r >>= 1;
+    }
+    bit >>= 2;
+  }
+  return r;
+}
+
+/* distance covered while changing speed between v0 and v at rate a */
+static inline long long planner_ramp_dist(long long v0, long long v, int a)
+{
+  return a > 0 ? (v * v - v0 * v0) / (2LL * a) : 0;
+}
+
+/*
+ * Split the major axis distance of a move into constant speed pieces.
+ * major[] receives the length and speed[] the speed of each piece, returns
+ * the number of pieces.
+ */
+static inline int planner_profile(const struct planner_config *cfg, int accel, int decel,
+                                  int dist, int speed, int *major, int *speeds, int max)
+{
+  long long v0 = cfg->start_speed;
+  long long vpeak = speed;
+  long long da, dd, pos = 0;
+  long long bounds[2 * PLANNER_RAMP_STEPS + 2];
+  long long levels[2 * PLANNER_RAMP_STEPS + 1];
+  int n = 0, k, count = 0;
+
+  if (v0 <= 0 || v0 > speed)
+    v0 = speed;
+
+  // no ramp needed or possible, a single segment at the requested speed
+  if ((accel == 0 && decel == 0) || vpeak <= v0 || dist == 0 || max < 2 * PLANNER_RAMP_STEPS + 1) {
+    major[0] = dist;
+    speeds[0] = speed;
+    return 1;
+  }
+
+  // lower the peak when there is not enough room to reach it and come back down
+  if (planner_ramp_dist(v0, vpeak, accel) + planner_ramp_dist(v0, vpeak, decel) > dist) {
+    long long v2;
+    if (accel == 0)
+      v2 = v0 * v0 + 2LL * dist * decel;
+    else if (decel == 0)
+      v2 = v0 * v0 + 2LL * dist * accel;
+    else
+      v2 = v0 * v0 + 2LL * dist * accel / (accel + decel) * decel;
+    vpeak = planner_isqrt(v2);
+    if (vpeak > speed)
+      vpeak = speed;
+    if (vpeak < v0)
+      vpeak = v0;
+  }
+  da = planner_ramp_dist(v0, vpeak, accel);
+  dd = planner_ramp_dist(v0, vpeak, decel);
+  if (da + dd > dist)
+    dd = dist - da;
+
+  // acceleration: each piece runs at the level reached at its start
+  for (k = 0; k < PLANNER_RAMP_STEPS && accel > 0; k++) {
+    long long v = v0 + (vpeak - v0) * (k + 1) / PLANNER_RAMP_STEPS;
+    levels[n] = v0 + (vpeak - v0) * k / PLANNER_RAMP_STEPS;
+    bounds[n++] = planner_ramp_dist(v0, v, accel);
+  }
+  // cruise
+  levels[n] = vpeak;
+  bounds[n++] = dist - dd;
+  // deceleration: each piece runs at the level it has to be down to at its end
+  for (k = PLANNER_RAMP_STEPS - 1; k >= 0 && decel > 0; k--) {
+    long long v = v0 + (vpeak - v0) * k / PLANNER_RAMP_STEPS;
+    levels[n] = v;
+    bounds[n++] = dist - planner_ramp_dist(v0, v, decel);
+  }
+
+  for (k = 0; k < n; k++) {
+    long long end = bounds[k] < pos ? pos : (bounds[k] > dist ? dist : bounds[k]);
+    if (k == n - 1)
+      end = dist;
+    if (end == pos)
+      continue;
+    if (count > 0 && speeds[count - 1] == levels[k]) {
+      major[count - 1] += end - pos;
+    } else {
+      major[count] = end - pos;
+      speeds[count] = levels[k];
+      count++;
+    }
+    pos = end;
+  }
+  return count;
+}
+
+/* steps of the longer axis */
+static inline int planner_major(const struct motor_segment *seg)
+{
+  int ax = planner_abs(seg->x), ay = planner_abs(seg->y);
+  return ax > ay ? ax : ay;
+}
+
+/* position of an axis that covers total steps after pos of major steps */
+static inline int planner_lerp(int total, int pos, int major)
+{
+  long long v = (long long) planner_abs(total) * pos * 2 + major;
+  int steps = (int) (v / (2LL * major));
+  return total < 0 ? -steps : steps;
+}
+
+/*
+ * Plan a relative move of dx, dy steps at the requested speed. Fills segs
+ * with at most max segments and returns how many were used, 0 for an empty
+ * move. Without interpolation the shorter axis moves at the same step rate
+ * as the longer one until it is done, the way the driver runs a single move.
+ */
+static inline int planner_plan(const struct planner_config *cfg, int dx, int dy, int speed,
+                               struct motor_segment *segs, int max)
+{
+  int major[PLANNER_MAX_SEGMENTS];
+  int speeds[PLANNER_MAX_SEGMENTS];
+  int adx = planner_abs(dx), ady = planner_abs(dy);
+  int dist = adx > ady ? adx : ady;
+  int accel = planner_limit(cfg->x.accel, adx != 0, cfg->y.accel, ady != 0);
+  int decel = planner_limit(cfg->x.decel, adx != 0, cfg->y.decel, ady != 0);
+  int remx = adx, remy = ady;
+  int n, i;
+
+  if (dist == 0 || max <= 0)
+    return 0;
+  if (max > PLANNER_MAX_SEGMENTS)
+    max = PLANNER_MAX_SEGMENTS;
+
+  n = planner_profile(cfg, accel, decel, dist, speed, major, speeds, max);
+  if (cfg->interp_steps > 0) {
+    int pos = 0;
+    for (i = 0; i < n; i++) {
+      segs[i].x = planner_lerp(dx, pos + major[i], dist) - planner_lerp(dx, pos, dist);
+      segs[i].y = planner_lerp(dy, pos + major[i], dist) - planner_lerp(dy, pos, dist);
+      segs[i].speed = speeds[i];
+      pos += major[i];
+    }
+    return n;
+  }
+
+  for (i = 0; i < n; i++) {
+    int sx = major[i] < remx ? major[i] : remx;
+    int sy = major[i] < remy ? major[i] : remy;
+    remx -= sx;
+    remy -= sy;
+    segs[i].x = dx < 0 ? -sx : sx;
+    segs[i].y = dy < 0 ? -sy : sy;
+    segs[i].speed = speeds[i];
+  }
+  return n;
+}
+
+/*
+ * Next sub-move of a segment once done of its major steps have been run,
+ * at most chunk major steps long (0 = the rest of the segment). Both axes
+ * stay on the segment's straight line.
+ */
+static inline struct motor_segment planner_chunk(const struct motor_segment *seg, int done, int chunk)
+{
+  struct motor_segment sub;
+  int major = planner_major(seg);
+  int end = (chunk > 0 && done + chunk < major) ? done + chunk : major;
+
+  sub.x = planner_lerp(seg->x, end, major) - planner_lerp(seg->x, done, major);
+  sub.y = planner_lerp(seg->y, end, major) - planner_lerp(seg->y, done, major);
+  sub.speed = seg->speed;
+  return sub;
+}
+
+/* expected run time of a segment in ms, at least 1 */
+static inline int planner_segment_ms(const struct motor_segment *seg)
+{
+  int steps = planner_major(seg);
+  long long ms = seg->speed > 0 ? (long long) steps * 1000 / seg->speed : 0;
+  return ms > 0 ? (int) ms : 1;
+}
+
+/* grid positions along one axis: lo, lo + step, ... and hi */
+static inline long long planner_scan_count(int lo, int hi, int step)
+{
+  return ((long long) hi - lo + step - 1) / step + 1;
+}
+
+static inline int planner_scan_at(int lo, int hi, int step, int n, int i)
+{
+  return i == n - 1 ? hi : (int) (lo + (long long) i * step);
+}
+
+/*
+ * Order the points of a grid scan over x_min..x_max, y_min..y_max for a
+ * motor at from_x, from_y. The scan starts at the corner nearest the motor
+ * and sweeps back and forth along the axis that makes the shorter path: rows
+ * along X cost a full width per row plus the height once, columns along Y the
+ * other way round. Fills px, py and returns the number of points, -1 if the
+ * grid is empty or has more than max points.
+ */
+static inline int planner_scan(int x_min, int y_min, int x_max, int y_max, int x_step, int y_step,
+                               int from_x, int from_y, int *px, int *py, int max)
+{
+  long long nx, ny;
+  bool along_x, rev_x, rev_y;
+  int ninner, nouter, i, j, n = 0;
+
+  if (x_step <= 0 || y_step <= 0 || x_max < x_min || y_max < y_min)
+    return -1;
+  nx = planner_scan_count(x_min, x_max, x_step);
+  ny = planner_scan_count(y_min, y_max, y_step);
+  if (nx > max || ny > max || nx * ny > max)
+    return -1;
+
+  rev_x = (long long) from_x - x_min > (long long) x_max - from_x;
+  rev_y = (long long) from_y - y_min > (long long) y_max - from_y;
+  along_x = ny * ((long long) x_max - x_min) + ((long long) y_max - y_min) <=
+            nx * ((long long) y_max - y_min) + ((long long) x_max - x_min);
+  ninner = along_x ? nx : ny;
+  nouter = along_x ? ny : nx;
+
+  for (i = 0; i < nouter; i++) {
+    for (j = 0; j < ninner; j++, n++) {
+      int k = i % 2 ? ninner - 1 - j : j;
+      int ix = along_x ? k : i, iy = along_x ? i : k;
+      if (rev_x)
+        ix = nx - 1 - ix;
+      if (rev_y)
+        iy = ny - 1 - iy;
+      px[n] = planner_scan_at(x_min, x_max, x_step, nx, ix);
+      py[n] = planner_scan_at(y_min, y_max, y_step, ny, iy);
+    }
+  }
+  return n;
+}
+
+#endif
@@ -0,0 +1,297 @@
+#ifndef MOTOR_PROTOCOL_H
+#define MOTOR_PROTOCOL_H
+
+/*
+ * Wire protocol between ingenic-motor and motors-daemon over SV_SOCK_PATH.
+ *
+ * Every message in either direction is a frame: a fixed struct motor_frame
+ * header followed by length bytes of payload. Requests carry a struct
+ * request, optionally followed by command specific data. The daemon answers
+ * every request with exactly one reply frame holding the request's id and a
+ * status code, plus the command's answer as payload. Replies to requests
+ * that wait for the motor may come after replies to later requests, clients
+ * match them up by id. Status pushed to subscribers comes as event frames
+ * carrying the id of the subscribe request, with flags telling what the
+ * event is.
+ *
+ * The header layout stays the same across versions, so a daemon can always
+ * tell a client that it does not speak its version.
+ */
+
+#include <stdint.h>
+
+#define SV_SOCK_PATH "/dev/md"
+
+#define MOTOR_PROTO_MAGIC 0x4d      // 'M'
+#define MOTOR_PROTO_VERSION 1
+#define MOTOR_MAX_PAYLOAD 1024
+
+/* frame kinds */
+#define MOTOR_FRAME_REQUEST 0x1
+#define MOTOR_FRAME_REPLY 0x2
+#define MOTOR_FRAME_EVENT 0x3
+
+/* reply status */
+#define MOTOR_OK 0x0
+#define MOTOR_ERR_VERSION 0x1       // protocol version not supported
+#define MOTOR_ERR_LENGTH 0x2        // payload too short or too long
+#define MOTOR_ERR_COMMAND 0x3       // unknown command
+#define MOTOR_ERR_TYPE 0x4          // unknown type for the command
+#define MOTOR_ERR_BUSY 0x5          // too many outstanding requests
+#define MOTOR_ERR_TIMEOUT 0x6       // wait ran out before the motor was idle
+#define MOTOR_ERR_HOMING 0x7        // move refused while the motor is homing
+#define MOTOR_ERR_NOENT 0x8         // no such preset
+#define MOTOR_ERR_FULL 0x9          // preset table full
+#define MOTOR_ERR_EXISTS 0xa        // preset name taken by another id
+#define MOTOR_ERR_RANGE 0xb         // scan grid empty or larger than a route holds
+#define MOTOR_ERR_IO 0xc            // the daemon could not write a file
+
+/* request flags */
+#define MOTOR_FLAG_NO_QUEUE 0x1     // fail moves while homing instead of running them after it
+
+/* event flags, what an event frame carries */
+#define MOTOR_EVENT_STATUS 0x0      // struct motor_status_reply, the status changed or its period came
+#define MOTOR_EVENT_ARRIVED 0x1     // struct motor_arrival, a tour or scan reached a point
+
+struct motor_frame
+{
+  uint8_t magic;
+  uint8_t version;
+  uint8_t kind;
+  uint8_t status;       // replies only, MOTOR_OK or MOTOR_ERR_*
+  uint16_t length;      // payload bytes after the header
+  uint16_t flags;       // MOTOR_FLAG_* for requests, MOTOR_EVENT_* for events
+  uint32_t id;          // chosen by the client, echoed in replies and events
+};
+
+struct request
+{
+  char command;   // d,r,s,p,b,S,i,j,e,C,M,w,u,P,T,X (move, reset, set speed, get position, is busy, Status, initial, JSON, estimate, counters, metrics, wait, subscribe, preset, tour, trace)
+  char type;      // g,h,c,s,b,v,k (relative, absolute, cruise, stop, go back, velocity, track), x,y,b for I, s,d,l,g for P (set, delete, list, goto),
+                  // s,g,p,r,q,i for T (start tour, grid scan, pause, resume, quit, info), d,f for X (dump, filter)
+  uint8_t got_x;
+  uint8_t got_y;
+  int32_t x;
+  int32_t y;
+  int32_t speed;  // 0 = keep the last known speed
+  int32_t wait;   // 'w' and moves: reply with the status once the motor is idle, timeout in ms
+};
+
+enum motor_status
+{
+  MOTOR_IS_STOP,
+  MOTOR_IS_RUNNING,
+  MOTOR_IS_HOMING,      // reported by the daemon during a reset sweep, never by the driver
+};
+
+/* answer to status requests, also the kernel's MOTOR_GET_STATUS layout, followed by struct motor_estimate */
+struct motor_message
+{
+  int x;
+  int y;
+  enum motor_status status;
+  int speed;
+  /* these two members are not standard from the original kernel module */
+  unsigned int x_max_steps;
+  unsigned int y_max_steps;
+  unsigned int inversion_state; // Report the inversion state
+};
+
+/* follows struct motor_message in status replies and status events */
+struct motor_estimate
+{
+  int32_t x;            // where the motor should be by now, the status position once stopped
+  int32_t y;
+  uint32_t age_ms;      // since the status read or piece start the estimate is based on
+};
+
+struct motor_status_reply
+{
+  struct motor_message msg;
+  struct motor_estimate estimate;
+};
+
+#define MOTOR_MAX_PRESETS 32
+#define MOTOR_PRESET_NAME 24
+
+/*
+ * A named position. Sent after struct request to pick the preset a 'P'
+ * command acts on, by id or, with id 0, by name. The answer to 'P' 'l' is an
+ * array of them.
+ */
+struct motor_preset
+{
+  int32_t id;           // 1..MOTOR_MAX_PRESETS, 0 = by name, or the first free id on set
+  int32_t x;            // driver coordinates, the same as 'd' 'h'
+  int32_t y;
+  char name[MOTOR_PRESET_NAME]; // NUL terminated, may be empty
+};
+
+#define MOTOR_MAX_WAYPOINTS 20
+
+/*
+ * One stop of a tour, sent in an array after the request for 'T' 's'. The
+ * position is a preset when at picks one by id or name, at.x and at.y
+ * otherwise.
+ */
+struct motor_waypoint
+{
+  struct motor_preset at;
+  int32_t speed;        // 0 = the last speed set
+  int32_t dwell_ms;     // time to stay once there
+};
+
+/* route states */
+#define MOTOR_ROUTE_IDLE 0
+#define MOTOR_ROUTE_MOVING 1
+#define MOTOR_ROUTE_DWELL 2
+#define MOTOR_ROUTE_PAUSED 3
+
+/* answer to every 'T' command */
+struct motor_route_status
+{
+  uint8_t state;        // MOTOR_ROUTE_*
+  uint8_t kind;         // 't' tour, 'g' grid scan
+  uint8_t loop;         // starts over after the last point
+  uint8_t reserved;
+  int32_t pos;          // point being moved to or dwelt at, from 0
+  int32_t len;          // points in the route
+};
+
+#define MOTOR_SCAN_BOX 0x1  // scan the box given instead of the whole travel range
+
+/*
+ * Grid scan, sent after the request for 'T' 'g'. Points lie x_step and y_step
+ * apart from the low corner of the box, plus the far edges when the steps do
+ * not land on them, and are visited in serpentine order.
+ */
+struct motor_scan
+{
+  int32_t x_min;
+  int32_t y_min;
+  int32_t x_max;
+  int32_t y_max;
+  int32_t x_step;
+  int32_t y_step;
+  int32_t dwell_ms;     // time to stay at each point
+  uint32_t flags;       // MOTOR_SCAN_*
+};
+
+/* MOTOR_EVENT_ARRIVED, sent to subscribers as a route reaches each point */
+struct motor_arrival
+{
+  struct motor_route_status route;
+  int32_t x;            // where the motor stopped
+  int32_t y;
+};
+
+/* answer to the 'C' command */
+struct daemon_counters
+{
+  uint32_t ioctls;      // MOTOR_GET_STATUS calls made
+  uint32_t hits;        // status lookups answered without an ioctl
+  uint32_t moves;       // 'g' and 'h' requests received
+  uint32_t merged;      // of those, folded into another move before reaching the driver
+  uint32_t ready_ms;    // from daemon start to accepting connections
+  uint32_t homed_ms;    // from daemon start to the end of the first homing sweep, 0 until then
+  uint32_t targets;     // 'k' tracking targets received
+  uint32_t target_moves; // of those, far enough off to move the motor
+};
+
+#define MOTOR_HIST_BUCKETS 16
+
+/*
+ * Latency histogram. Bucket 0 counts times under 1 us, bucket i times from
+ * 2^(i-1) us up to 2^i us, and the last bucket everything from 16 ms on.
+ */
+struct motor_histogram
+{
+  uint32_t count;
+  uint32_t max_us;
+  uint64_t sum_us;
+  uint32_t bucket[MOTOR_HIST_BUCKETS];
+};
+
+#define MOTOR_METRICS_IOCTLS 7         // driver commands MOTOR_STOP (1) to MOTOR_CRUISE (7)
+#define MOTOR_METRICS_MAX_COMMANDS 24
+
+/* time the daemon took to run one kind of request, not counting waits */
+struct motor_command_metrics
+{
+  uint8_t command;      // request command, '?' for unknown ones
+  uint8_t reserved[7];
+  struct motor_histogram time;
+};
+
+/* answer to the 'M' command, followed by ncommands struct motor_command_metrics */
+struct motor_metrics
+{
+  uint32_t uptime_ms;
+  uint32_t connections;         // open now
+  uint32_t connections_peak;
+  uint32_t accepted;            // since start
+  uint32_t queue_depth;         // commands waiting for the control thread now
+  uint32_t queue_peak;
+  uint32_t ncommands;
+  uint32_t reserved;
+  struct motor_histogram socket_read;   // each read on a client socket
+  struct motor_histogram socket_write;  // each send to one
+  struct motor_histogram ioctl[MOTOR_METRICS_IOCTLS]; // by driver command - 1
+};
+
+#define MOTOR_TRACE_PATH_SIZE 64
+
+/* answer to 'X', x of 'X' 'f' is the new mask */
+struct motor_trace_info
+{
+  uint32_t written;     // trace records written since start
+  uint32_t mask;        // categories traced, bits as in motor-trace.h
+  char path[MOTOR_TRACE_PATH_SIZE]; // dump file, NUL terminated
+};
+
+static inline void motor_frame_init(struct motor_frame *hdr, uint8_t kind, uint32_t id, uint16_t length)
+{
+  hdr->magic = MOTOR_PROTO_MAGIC;
+  hdr->version = MOTOR_PROTO_VERSION;
+  hdr->kind = kind;
+  hdr->status = MOTOR_OK;
+  hdr->length = length;
+  hdr->flags = 0;
+  hdr->id = id;
+}
+
+static inline const char *motor_strerror(int status)
+{
+  switch (status) {
+  case MOTOR_OK:
+    return "ok";
+  case MOTOR_ERR_VERSION:
+    return "protocol version not supported";
+  case MOTOR_ERR_LENGTH:
+    return "bad request length";
+  case MOTOR_ERR_COMMAND:
+    return "unknown command";
+  case MOTOR_ERR_TYPE:
+    return "unknown command type";
+  case MOTOR_ERR_BUSY:
+    return "too many outstanding requests";
+  case MOTOR_ERR_TIMEOUT:
+    return "timed out";
+  case MOTOR_ERR_HOMING:
+    return "motor is homing";
+  case MOTOR_ERR_NOENT:
+    return "no such preset";
+  case MOTOR_ERR_FULL:
+    return "preset table full";
+  case MOTOR_ERR_EXISTS:
+    return "preset name already in use";
+  case MOTOR_ERR_RANGE:
+    return "scan grid empty or too large";
+  case MOTOR_ERR_IO:
+    return "could not write the file";
+  default:
+    return "unknown error";
+  }
+}
+
+#endif
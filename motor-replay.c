@@ -0,0 +1,541 @@
+/*
+ * motor-replay: send a request capture back to motors-daemon.
+ *
+ * Reads a capture written by the daemon's -R option and sends every request
+ * again on as many connections as it came in on, at the captured pace, a
+ * multiple of it or as fast as the daemon takes them. Each reply is timed
+ * and its status compared with the captured one. Once all are answered it
+ * waits for the motor to stop and compares where it stopped with the last
+ * position in the capture. The motor is first moved to where it was before
+ * the captured traffic, so a replay against the simulated motor runs the
+ * same way every time:
+ *
+ *   motors-daemon -p -s 2130,1600 -R /tmp/capture
+ *   ... traffic ...
+ *   motor-replay -x 0 /tmp/capture
+ *
+ * Replay latencies are round trips as a client sees them. The captured ones
+ * are the daemon's own, from reading a request to queueing its reply, so they
+ * leave out the socket and are a floor for the replayed ones rather than
+ * their equal. Subscriptions are left out, their connections would never be
+ * done.
+ *
+ * Build with: make motor-replay, see the Makefile
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "motor-protocol.h"
+#include "motor-client.h"
+#include "motor-capture.h"
+
+#define REPLAY_MAX_OPEN 256      // connections open at once
+#define REPLAY_MAX_INFLIGHT 32   // unanswered requests per connection before sending waits
+#define REPLAY_MATCH_WINDOW 4096 // requests searched back for the one a reply answers
+#define REPLAY_MAX_GROUPS 32
+
+/* one captured request, and how it went then and now */
+struct replay_request
+{
+  uint64_t stamp_us;            // since the capture started
+  uint32_t conn;
+  uint32_t id;
+  uint16_t flags;
+  uint16_t length;
+  unsigned char *payload;       // starts with struct request
+  int captured_status;          // -1 when the capture holds no reply
+  uint64_t captured_ns;
+  int status;                   // -1 until answered
+  uint64_t sent_ns;
+  uint64_t latency_ns;
+  bool skipped;
+};
+
+struct replay_conn
+{
+  struct motor_client *mc;      // NULL until the first request, and once done
+  int last;                     // index of its last request
+  int inflight;
+};
+
+struct replay_request *requests = NULL;
+int nrequests = 0;
+struct replay_conn *conns = NULL;
+uint32_t nconns = 0;             // highest connection number + 1
+uint32_t conns_used = 0;         // connections the requests came in on
+struct motor_message start_pos, final_pos;
+bool have_position = false;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct request *request_of(struct replay_request *r)
+{
+  return (struct request *) r->payload;
+}
+
+/* the request a reply on conn with id answers, searching back from the newest */
+static struct replay_request *request_match(int newest, uint32_t conn, uint32_t id, bool captured)
+{
+  int i;
+
+  for (i = newest; i >= 0 && i > newest - REPLAY_MATCH_WINDOW; i--) {
+    struct replay_request *r = &requests[i];
+    if (r->conn != conn || r->id != id)
+      continue;
+    if (captured ? r->captured_status == -1 : (r->status == -1 && r->sent_ns != 0))
+      return r;
+  }
+  return NULL;
+}
+
+static int capture_load(const char *path)
+{
+  struct motor_capture_header hdr;
+  struct motor_capture_record rec;
+  unsigned char payload[MOTOR_MAX_PAYLOAD];
+  int size = 0, ret, i;
+  uint32_t c;
+  FILE *f = fopen(path, "rb");
+
+  if (f == NULL) {
+    printf("Could not open %s\n", path);
+    return -1;
+  }
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != MOTOR_CAPTURE_MAGIC ||
+      hdr.version != MOTOR_CAPTURE_VERSION) {
+    printf("%s is not a request capture\n", path);
+    fclose(f);
+    return -1;
+  }
+
+  while ((ret = motor_capture_read(f, &rec, payload, sizeof(payload))) == 1) {
+    if (rec.kind == MOTOR_CAPTURE_POSITION && rec.length >= sizeof(struct motor_message)) {
+      if (!have_position)
+        memcpy(&start_pos, payload, sizeof(start_pos));
+      memcpy(&final_pos, payload, sizeof(final_pos));
+      have_position = true;
+    } else if (rec.kind == MOTOR_CAPTURE_REPLY) {
+      struct replay_request *r = request_match(nrequests - 1, rec.conn, rec.id, true);
+      if (r != NULL) {
+        r->captured_status = rec.status;
+        r->captured_ns = (rec.stamp_us - r->stamp_us) * 1000;
+      }
+    } else if (rec.kind == MOTOR_CAPTURE_REQUEST && rec.length >= sizeof(struct request) &&
+               rec.length <= MOTOR_MAX_PAYLOAD) {
+      struct replay_request *r;
+      if (nrequests == size) {
+        size = size ? 2 * size : 1024;
+        requests = realloc(requests, size * sizeof(struct replay_request));
+        if (requests == NULL) {
+          printf("Out of memory\n");
+          fclose(f);
+          return -1;
+        }
+      }
+      r = &requests[nrequests++];
+      memset(r, 0, sizeof(*r));
+      r->stamp_us = rec.stamp_us;
+      r->conn = rec.conn;
+      r->id = rec.id;
+      r->flags = rec.flags;
+      r->length = rec.length;
+      r->payload = malloc(rec.length);
+      if (r->payload == NULL) {
+        printf("Out of memory\n");
+        fclose(f);
+        return -1;
+      }
+      memcpy(r->payload, payload, rec.length);
+      r->captured_status = -1;
+      r->status = -1;
+      // a subscription streams until its connection closes, leave it out
+      r->skipped = request_of(r)->command == 'u';
+      if (rec.conn >= nconns)
+        nconns = rec.conn + 1;
+    }
+  }
+  fclose(f);
+  if (ret == -1)
+    printf("%s is cut short, replaying what it holds\n", path);
+
+  conns = calloc(nconns ? nconns : 1, sizeof(struct replay_conn));
+  if (conns == NULL) {
+    printf("Out of memory\n");
+    return -1;
+  }
+  for (c = 0; c < nconns; c++)
+    conns[c].last = -1;
+  for (i = 0; i < nrequests; i++) {
+    if (conns[requests[i].conn].last == -1)
+      conns_used++;
+    conns[requests[i].conn].last = i;
+  }
+  return 0;
+}
+
+/* a request on a connection of its own that waits for the answer, for setup and the final position */
+static int control_request(struct request *req, struct motor_status_reply *reply)
+{
+  static struct motor_client mc;
+  int status;
+
+  if (motor_client_open(&mc, 0) == -1)
+    return -1;
+  status = motor_client_call(&mc, req, 0, NULL, 0, reply, sizeof(*reply));
+  motor_client_close(&mc);
+  return status;
+}
+
+static void conn_close(struct replay_conn *c)
+{
+  motor_client_close(c->mc);
+  free(c->mc);
+  c->mc = NULL;
+}
+
+static void conn_done(struct replay_conn *c, int index)
+{
+  if (c->mc != NULL && c->inflight == 0 && index >= c->last && c->mc->outlen == 0)
+    conn_close(c);
+}
+
+/*
+ * Send the requests at their time and collect the replies as they come. A
+ * connection opens with its first request and closes once its last one is
+ * answered, as the captured client's did.
+ */
+static int replay_run(double factor, int settle_ms, uint64_t *elapsed_ns)
+{
+  struct pollfd fds[REPLAY_MAX_OPEN];
+  uint32_t owner[REPLAY_MAX_OPEN];
+  unsigned char payload[sizeof(struct motor_status_reply)];
+  uint64_t started = now_ns(), progress = started;
+  uint64_t first_us = nrequests ? requests[0].stamp_us : 0;
+  int next = 0, inflight = 0, nfds, i;
+  uint32_t c;
+
+  while (next < nrequests || inflight > 0) {
+    uint64_t now = now_ns();
+    int timeout = 1000;
+
+    while (next < nrequests) {
+      struct replay_request *r = &requests[next];
+      struct replay_conn *conn = &conns[r->conn];
+      uint64_t due = started + (factor > 0 ? (uint64_t) ((r->stamp_us - first_us) * 1000 / factor) : 0);
+
+      if (r->skipped) {
+        conn_done(conn, next++);
+        continue;
+      }
+      if (due > now) {
+        timeout = (due - now) / 1000000 + 1;
+        break;
+      }
+      if (conn->inflight == REPLAY_MAX_INFLIGHT)
+        break;
+      if (conn->mc == NULL) {
+        conn->mc = malloc(sizeof(struct motor_client));
+        if (conn->mc == NULL || motor_client_open(conn->mc, MOTOR_CLIENT_NONBLOCK) == -1) {
+          printf("Could not connect to the daemon\n");
+          return -1;
+        }
+      }
+      r->sent_ns = now_ns();
+      // what does not go out now goes once the socket takes it, see POLLOUT below
+      if (motor_client_queue_frame(conn->mc, r->id, r->flags, r->payload, r->length) == -1 ||
+          motor_client_flush(conn->mc) == -1) {
+        printf("Connection to the daemon lost\n");
+        return -1;
+      }
+      conn->inflight++;
+      inflight++;
+      next++;
+    }
+
+    nfds = 0;
+    for (c = 0; c < nconns && nfds < REPLAY_MAX_OPEN; c++) {
+      if (conns[c].mc == NULL || conns[c].inflight == 0)
+        continue;
+      fds[nfds].fd = conns[c].mc->fd;
+      fds[nfds].events = conns[c].mc->outlen ? POLLIN | POLLOUT : POLLIN;
+      owner[nfds++] = c;
+    }
+    // with nothing to read this sleeps until the next request is due
+    if (poll(fds, nfds, timeout) == -1 && errno != EINTR)
+      return -1;
+
+    for (i = 0; i < nfds; i++) {
+      struct replay_conn *conn = &conns[owner[i]];
+      struct motor_frame hdr;
+      struct replay_request *r;
+      int ret = 0;
+
+      if ((fds[i].revents & POLLOUT) && motor_client_flush(conn->mc) == -1)
+        ret = -1;
+      // take every whole frame in, poll does not know about the ones already buffered
+      while (ret != -1 && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+             (ret = motor_client_next(conn->mc, &hdr, payload, sizeof(payload))) == 1) {
+        if (hdr.kind != MOTOR_FRAME_REPLY)
+          continue;
+        r = request_match(next - 1, owner[i], hdr.id, false);
+        if (r == NULL)
+          continue;
+        r->latency_ns = now_ns() - r->sent_ns;
+        r->status = hdr.status;
+        conn->inflight--;
+        inflight--;
+        progress = now_ns();
+      }
+      if (ret == -1) {
+        printf("Connection to the daemon lost\n");
+        return -1;
+      }
+      conn_done(conn, next - 1);
+    }
+
+    if (inflight > 0 && now_ns() - progress > (uint64_t) settle_ms * 1000000) {
+      printf("No reply for %d ms, giving up on %d requests\n", settle_ms, inflight);
+      break;
+    }
+  }
+  *elapsed_ns = now_ns() - started;
+
+  for (c = 0; c < nconns; c++)
+    if (conns[c].mc != NULL)
+      conn_close(&conns[c]);
+  return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* nearest rank percentile of sorted values, in microseconds */
+static double percentile_us(const uint64_t *sorted, size_t n, double p)
+{
+  size_t rank;
+
+  if (n == 0)
+    return 0;
+  rank = (size_t) (p / 100.0 * n + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > n)
+    rank = n;
+  return sorted[rank - 1] / 1000.0;
+}
+
+/* latencies of one kind of request, now and as captured */
+struct replay_group
+{
+  char name[4];
+  size_t count;
+  double p50, p99, max;
+  size_t captured_count;
+  double captured_p50, captured_p99, captured_max;
+};
+
+static void group_name(struct replay_request *r, char *name)
+{
+  struct request *req = request_of(r);
+
+  name[0] = req->command;
+  name[1] = strchr("dPTXI", req->command) && req->type > ' ' ? req->type : '\0';
+  name[2] = '\0';
+}
+
+static void summarize(struct replay_group *g, uint64_t *now, size_t n, uint64_t *captured, size_t nc)
+{
+  qsort(now, n, sizeof(uint64_t), compare_u64);
+  qsort(captured, nc, sizeof(uint64_t), compare_u64);
+  g->count = n;
+  g->p50 = percentile_us(now, n, 50);
+  g->p99 = percentile_us(now, n, 99);
+  g->max = n ? now[n - 1] / 1000.0 : 0;
+  g->captured_count = nc;
+  g->captured_p50 = percentile_us(captured, nc, 50);
+  g->captured_p99 = percentile_us(captured, nc, 99);
+  g->captured_max = nc ? captured[nc - 1] / 1000.0 : 0;
+}
+
+static void usage(char *progname)
+{
+  printf("Usage : %s [options] capture\n"
+         "\t -x F replay at F times the captured pace, 0 as fast as the daemon takes it (default 1)\n"
+         "\t -n start from wherever the motor is instead of the captured start position\n"
+         "\t -w ms longest wait for a reply and for the motor to stop at the end (default 60000)\n"
+         "\t -J print one json line instead of the report\n"
+         "\t Exits with 1 when the motor ends up elsewhere or a reply status differs\n",
+         progname);
+}
+
+int main(int argc, char *argv[])
+{
+  struct replay_group groups[REPLAY_MAX_GROUPS + 1];
+  char names[REPLAY_MAX_GROUPS][4];
+  struct motor_status_reply end;
+  struct request req;
+  double factor = 1;
+  int settle_ms = 60000, ngroups = 0, skipped = 0, unanswered = 0, mismatched = 0;
+  int sent = 0, i, j, c;
+  bool json = false, from_start = true, diverged;
+  uint64_t elapsed = 0, captured_us;
+  uint64_t *now_part, *captured_part;
+  size_t n, nc;
+
+  while ((c = getopt(argc, argv, "x:nw:Jh")) != -1) {
+    switch (c) {
+    case 'x':
+      factor = atof(optarg);
+      break;
+    case 'n':
+      from_start = false;
+      break;
+    case 'w':
+      settle_ms = atoi(optarg);
+      break;
+    case 'J':
+      json = true;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1 || factor < 0 || settle_ms <= 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (capture_load(argv[optind]) != 0)
+    return EXIT_FAILURE;
+  if (nrequests == 0) {
+    printf("No requests in %s\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  if (from_start && have_position) {
+    memset(&req, 0, sizeof(req));
+    req.command = 'd';
+    req.type = 'h';
+    req.got_x = 1;
+    req.got_y = 1;
+    req.x = start_pos.x;
+    req.y = start_pos.y;
+    req.speed = start_pos.speed;
+    req.wait = settle_ms;
+    if (control_request(&req, &end) != MOTOR_OK) {
+      printf("Could not move to the captured start position X %d, Y %d\n", start_pos.x, start_pos.y);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (replay_run(factor, settle_ms, &elapsed) != 0)
+    return EXIT_FAILURE;
+
+  memset(&req, 0, sizeof(req));
+  req.command = 'w';
+  req.wait = settle_ms;
+  if (control_request(&req, &end) == -1) {
+    printf("Could not read the final position\n");
+    return EXIT_FAILURE;
+  }
+
+  now_part = malloc(nrequests * sizeof(uint64_t));
+  captured_part = malloc(nrequests * sizeof(uint64_t));
+  if (now_part == NULL || captured_part == NULL) {
+    printf("Out of memory\n");
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < nrequests; i++) {
+    struct replay_request *r = &requests[i];
+    char name[4];
+    if (r->skipped) {
+      skipped++;
+      continue;
+    }
+    sent += r->sent_ns != 0;
+    if (r->status == -1)
+      unanswered++;
+    else if (r->captured_status != -1 && r->status != r->captured_status)
+      mismatched++;
+    group_name(r, name);
+    for (j = 0; j < ngroups && strcmp(names[j], name) != 0; j++)
+      ;
+    if (j == ngroups && ngroups < REPLAY_MAX_GROUPS)
+      strcpy(names[ngroups++], name);
+  }
+  for (j = 0; j <= ngroups; j++) {
+    n = nc = 0;
+    for (i = 0; i < nrequests; i++) {
+      struct replay_request *r = &requests[i];
+      char name[4];
+      if (r->skipped)
+        continue;
+      group_name(r, name);
+      if (j < ngroups && strcmp(names[j], name) != 0)
+        continue;
+      if (r->status != -1)
+        now_part[n++] = r->latency_ns;
+      if (r->captured_status != -1)
+        captured_part[nc++] = r->captured_ns;
+    }
+    summarize(&groups[j], now_part, n, captured_part, nc);
+    strcpy(groups[j].name, j < ngroups ? names[j] : "all");
+  }
+
+  captured_us = requests[nrequests - 1].stamp_us - requests[0].stamp_us;
+  diverged = have_position && (end.msg.x != final_pos.x || end.msg.y != final_pos.y);
+  if (json) {
+    printf("{\"requests\":%d,\"sent\":%d,\"skipped\":%d,\"unanswered\":%d,\"status_mismatches\":%d,"
+           "\"connections\":%u,\"factor\":%g,\"seconds\":%.3f,\"captured_seconds\":%.3f,",
+           nrequests, sent, skipped, unanswered, mismatched, conns_used, factor,
+           elapsed / 1e9, captured_us / 1e6);
+    if (have_position)
+      printf("\"final\":{\"captured\":[%d,%d],\"replayed\":[%d,%d],\"dx\":%d,\"dy\":%d},",
+             final_pos.x, final_pos.y, end.msg.x, end.msg.y, end.msg.x - final_pos.x, end.msg.y - final_pos.y);
+    printf("\"latency_us\":{");
+    for (j = 0; j <= ngroups; j++)
+      printf("%s\"%s\":{\"count\":%zu,\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f,"
+             "\"captured\":{\"count\":%zu,\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f}}",
+             j ? "," : "", groups[j].name, groups[j].count, groups[j].p50, groups[j].p99, groups[j].max,
+             groups[j].captured_count, groups[j].captured_p50, groups[j].captured_p99, groups[j].captured_max);
+    printf("}}\n");
+  } else {
+    printf("%d of %d requests on %u connections replayed in %.3f s, captured over %.3f s, ", sent, nrequests,
+           conns_used, elapsed / 1e9, captured_us / 1e6);
+    if (factor > 0)
+      printf("at %g times the captured pace\n", factor);
+    else
+      printf("as fast as possible\n");
+    printf("%d subscriptions left out, %d unanswered, %d replies with another status than captured\n",
+           skipped, unanswered, mismatched);
+    // captured times are the daemon's own, from reading a request to queueing its reply
+    printf("%-6s %8s %10s %10s %10s %10s %10s %10s\n", "cmd", "count", "p50 us", "p99 us", "max us",
+           "cap p50", "cap p99", "cap max");
+    for (j = 0; j <= ngroups; j++)
+      printf("%-6s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", groups[j].name, groups[j].count,
+             groups[j].p50, groups[j].p99, groups[j].max,
+             groups[j].captured_p50, groups[j].captured_p99, groups[j].captured_max);
+    if (have_position)
+      printf("Final position X %d, Y %d, captured X %d, Y %d%s\n", end.msg.x, end.msg.y,
+             final_pos.x, final_pos.y, diverged ? ", diverged" : "");
+    else
+      printf("Final position X %d, Y %d, none captured\n", end.msg.x, end.msg.y);
+  }
+  return diverged || mismatched || unanswered ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+#ifndef MOTOR_SHM_H
+#define MOTOR_SHM_H
+
+/*
+ * Status page shared between motors-daemon and its readers.
+ *
+ * The daemon publishes every motor status it reads into a small mmap'able
+ * file. Readers map it read-only and take snapshots without any syscall or
+ * lock: the daemon makes seq odd while it updates the page and even again
+ * once it is done, so a reader that sees the same even seq before and after
+ * its copy has a consistent snapshot.
+ *
+ * Next to the last status read the page holds how the motor is moving, so
+ * readers can estimate where it is between reads without asking for more.
+ *
+ * Commands are answered as soon as they are queued, before the daemon acts on
+ * them and marks the page stale. The daemon counts commands queued and done
+ * outside of seq, and the page only counts as current while the two match.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define MOTOR_SHM_PATH "/dev/shm/motors-status"
+#define MOTOR_SHM_MAGIC 0x524f544d // "MTOR"
+#define MOTOR_SHM_VERSION 3
+#define MOTOR_SHM_RETRIES 64
+
+/* same layout as struct motor_message */
+struct motor_shm_status
+{
+  int x;
+  int y;
+  int status;
+  int speed;
+  unsigned int x_max_steps;
+  unsigned int y_max_steps;
+  unsigned int inversion_state;
+};
+
+/*
+ * The motor was at x, y at stamp_ms, the time of the last status read or of
+ * the start of the running piece, and heads for to_x, to_y at vx, vy steps/s.
+ * Each axis stops on its own once it reaches its target, as the driver runs
+ * both at one step rate and the shorter one is done first.
+ */
+struct motor_motion
+{
+  int64_t stamp_ms;           // CLOCK_MONOTONIC
+  int32_t x;
+  int32_t y;
+  int32_t to_x;
+  int32_t to_y;
+  int32_t vx;                 // 0 once stopped
+  int32_t vy;
+};
+
+struct motor_shm
+{
+  uint32_t magic;
+  uint32_t version;
+  atomic_uint seq;            // odd while the daemon is writing
+  int32_t pid;                // publishing daemon
+  uint32_t stale;             // a command was issued, status not re-read yet
+  atomic_uint queued;         // seq of the last command accepted
+  atomic_uint done;           // seq of the last command acted on, published after its effect
+  int64_t stamp_ms;           // CLOCK_MONOTONIC ms when status was read
+  struct motor_shm_status status;
+  struct motor_motion motion;
+};
+
+static inline void motor_shm_write_begin(struct motor_shm *shm)
+{
+  unsigned int seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+  atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static inline void motor_shm_write_end(struct motor_shm *shm)
+{
+  unsigned int seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+  atomic_store_explicit(&shm->seq, seq + 1, memory_order_release);
+}
+
+/* one axis after ms at rate v from pos, never past to */
+static inline int motor_motion_axis(int pos, int to, int v, int64_t ms)
+{
+  int64_t p = pos + (int64_t) v * ms / 1000;
+  if ((v > 0 && p > to) || (v < 0 && p < to))
+    return to;
+  return (int) p;
+}
+
+/* estimated position at now_ms, CLOCK_MONOTONIC, each axis held at its own target */
+static inline void motor_motion_estimate(const struct motor_motion *m, int64_t now_ms, int *x, int *y)
+{
+  int64_t ms = now_ms > m->stamp_ms ? now_ms - m->stamp_ms : 0;
+  *x = motor_motion_axis(m->x, m->to_x, m->vx, ms);
+  *y = motor_motion_axis(m->y, m->to_y, m->vy, ms);
+}
+
+/* map the status page read-only, returns NULL if the daemon does not publish one */
+static inline const struct motor_shm *motor_shm_open(const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+
+  void *p = mmap(NULL, sizeof(struct motor_shm), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return NULL;
+
+  const struct motor_shm *shm = p;
+  if (shm->magic != MOTOR_SHM_MAGIC || shm->version != MOTOR_SHM_VERSION) {
+    munmap(p, sizeof(struct motor_shm));
+    return NULL;
+  }
+  return shm;
+}
+
+static inline void motor_shm_close(const struct motor_shm *shm)
+{
+  if (shm)
+    munmap((void *) shm, sizeof(struct motor_shm));
+}
+
+/*
+ * Take a consistent copy of the published status. Returns 0 on success, -1 if
+ * the page is marked stale, a command is still queued or the writer kept it
+ * busy for every retry, in which case the caller should ask the daemon over
+ * the socket. motion may be NULL.
+ */
+static inline int motor_shm_snapshot(const struct motor_shm *shm, struct motor_shm_status *out, int64_t *stamp_ms,
+                                     struct motor_motion *motion)
+{
+  int tries;
+
+  // a command still queued may change the status, read done after queued
+  unsigned int queued = atomic_load_explicit((atomic_uint *) &shm->queued, memory_order_acquire);
+  if (atomic_load_explicit((atomic_uint *) &shm->done, memory_order_acquire) != queued)
+    return -1;
+
+  for (tries = 0; tries < MOTOR_SHM_RETRIES; tries++) {
+    unsigned int seq = atomic_load_explicit((atomic_uint *) &shm->seq, memory_order_acquire);
+    if (seq & 1)
+      continue;
+
+    uint32_t stale = shm->stale;
+    int64_t stamp = shm->stamp_ms;
+    memcpy(out, (const void *) &shm->status, sizeof(struct motor_shm_status));
+    if (motion)
+      memcpy(motion, (const void *) &shm->motion, sizeof(struct motor_motion));
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit((atomic_uint *) &shm->seq, memory_order_relaxed) != seq)
+      continue;
+
+    if (stale)
+      return -1;
+    if (stamp_ms)
+      *stamp_ms = stamp;
+    return 0;
+  }
+  return -1;
+}
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef MOTOR_SIM_H
+#define MOTOR_SIM_H
+
+/*
+ * Simulated pan/tilt motor for running motors-daemon without /dev/motor.
+ *
+ * The model follows what the kernel module does closely enough for the
+ * daemon, planner and clients to be exercised and timed on any Linux box:
+ * moves step both axes at the set speed in steps/s, so the shorter axis of
+ * a diagonal move gets there first and the path bends, as with the driver.
+ * They stop at the ends of the travel range and report RUNNING until the
+ * longer axis is done. A homing reset blocks for as long as the sweep would
+ * take and leaves the motor centred, goback returns to the centre and cruise
+ * pans from end to end until stopped.
+ *
+ * Nothing runs in the background: the position is worked out from the
+ * monotonic clock whenever the simulator is asked, so it costs nothing while
+ * the motor is idle. The caller serialises access, as the driver does.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define MOTOR_SIM_MIN_SPEED 1
+#define MOTOR_SIM_MAX_SPEED 900     // the kernel module does not go any faster
+#define MOTOR_SIM_DEFAULT_SPEED 900
+
+enum motor_sim_mode
+{
+  MOTOR_SIM_IDLE,
+  MOTOR_SIM_MOVE,                   // from from_x, from_y to to_x, to_y
+  MOTOR_SIM_CRUISE,                 // back and forth along X until stopped
+};
+
+struct motor_sim
+{
+  int x_max;                        // travel range, positions run from 0 to it
+  int y_max;
+  int homing_ms;                    // length of a homing sweep, 0 = worked out from the speed
+  int speed;                        // steps/s of the longer axis
+  enum motor_sim_mode mode;
+  int64_t start_ms;                 // when the current motion started
+  int from_x;
+  int from_y;
+  int to_x;
+  int to_y;
+};
+
+static inline int64_t motor_sim_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline int motor_sim_abs(int v)
+{
+  return v < 0 ? -v : v;
+}
+
+static inline int motor_sim_clamp(int v, int max)
+{
+  return v < 0 ? 0 : (v > max ? max : v);
+}
+
+static inline void motor_sim_init(struct motor_sim *sim, int x_max, int y_max, int homing_ms)
+{
+  sim->x_max = x_max;
+  sim->y_max = y_max;
+  sim->homing_ms = homing_ms;
+  sim->speed = MOTOR_SIM_DEFAULT_SPEED;
+  sim->mode = MOTOR_SIM_IDLE;
+  sim->start_ms = 0;
+  sim->from_x = sim->to_x = x_max / 2;
+  sim->from_y = sim->to_y = y_max / 2;
+}
+
+/* position at now, true while the motor is still moving */
+static inline bool motor_sim_position(const struct motor_sim *sim, int64_t now, int *x, int *y)
+{
+  int64_t steps = (now - sim->start_ms) * sim->speed / 1000;
+  int dx = sim->to_x - sim->from_x, dy = sim->to_y - sim->from_y;
+  int major = motor_sim_abs(dx) > motor_sim_abs(dy) ? motor_sim_abs(dx) : motor_sim_abs(dy);
+
+  if (sim->mode == MOTOR_SIM_CRUISE) {
+    // a triangle wave over the X range, starting towards the far end
+    int64_t span = sim->x_max > 0 ? sim->x_max : 1;
+    int64_t p = (sim->from_x + steps) % (2 * span);
+    *x = (int) (p <= span ? p : 2 * span - p);
+    *y = sim->from_y;
+    return true;
+  }
+  if (sim->mode == MOTOR_SIM_IDLE || steps >= major) {
+    *x = sim->to_x;
+    *y = sim->to_y;
+    return false;
+  }
+  *x = sim->from_x + (int) (motor_sim_abs(dx) < steps ? dx : (dx < 0 ? -steps : steps));
+  *y = sim->from_y + (int) (motor_sim_abs(dy) < steps ? dy : (dy < 0 ? -steps : steps));
+  return true;
+}
+
+/* freeze the motion where it has got to */
+static inline void motor_sim_stop(struct motor_sim *sim)
+{
+  int x, y;
+
+  motor_sim_position(sim, motor_sim_now(), &x, &y);
+  sim->mode = MOTOR_SIM_IDLE;
+  sim->from_x = sim->to_x = x;
+  sim->from_y = sim->to_y = y;
+}
+
+/* start towards x, y from wherever the motor is, within the travel range */
+static inline void motor_sim_goto(struct motor_sim *sim, int x, int y)
+{
+  motor_sim_stop(sim);
+  sim->mode = MOTOR_SIM_MOVE;
+  sim->start_ms = motor_sim_now();
+  sim->to_x = motor_sim_clamp(x, sim->x_max);
+  sim->to_y = motor_sim_clamp(y, sim->y_max);
+}
+
+static inline void motor_sim_move(struct motor_sim *sim, int dx, int dy)
+{
+  int x, y;
+
+  motor_sim_position(sim, motor_sim_now(), &x, &y);
+  motor_sim_goto(sim, x + dx, y + dy);
+}
+
+static inline void motor_sim_goback(struct motor_sim *sim)
+{
+  motor_sim_goto(sim, sim->x_max / 2, sim->y_max / 2);
+}
+
+static inline void motor_sim_cruise(struct motor_sim *sim)
+{
+  motor_sim_stop(sim);
+  sim->mode = MOTOR_SIM_CRUISE;
+  sim->start_ms = motor_sim_now();
+}
+
+/* a speed change applies from now on, to the rest of a running move too */
+static inline void motor_sim_speed(struct motor_sim *sim, int speed)
+{
+  int64_t now = motor_sim_now();
+  int x, y;
+
+  // a finished move has to stay finished, at a lower speed it would resume
+  if (!motor_sim_position(sim, now, &x, &y))
+    sim->mode = MOTOR_SIM_IDLE;
+  sim->from_x = x;
+  sim->from_y = y;
+  sim->start_ms = now;
+  sim->speed = speed < MOTOR_SIM_MIN_SPEED ? MOTOR_SIM_MIN_SPEED :
+               (speed > MOTOR_SIM_MAX_SPEED ? MOTOR_SIM_MAX_SPEED : speed);
+}
+
+/*
+ * With a range given, take it and the position as they are, the way the
+ * driver is told where it is after a restart. Without one, sweep to both ends
+ * of each axis and back to the centre, blocking the caller meanwhile.
+ */
+static inline void motor_sim_reset(struct motor_sim *sim, int x_max, int y_max, int x, int y)
+{
+  if (x_max > 0 && y_max > 0) {
+    sim->x_max = x_max;
+    sim->y_max = y_max;
+    sim->mode = MOTOR_SIM_IDLE;
+    sim->from_x = sim->to_x = motor_sim_clamp(x, x_max);
+    sim->from_y = sim->to_y = motor_sim_clamp(y, y_max);
+    return;
+  }
+
+  int longest = sim->x_max > sim->y_max ? sim->x_max : sim->y_max;
+  int ms = sim->homing_ms > 0 ? sim->homing_ms : (int) ((int64_t) longest * 5 / 2 * 1000 / sim->speed);
+  struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+  while (nanosleep(&ts, &ts) == -1)
+    ;
+  sim->mode = MOTOR_SIM_IDLE;
+  sim->from_x = sim->to_x = sim->x_max / 2;
+  sim->from_y = sim->to_y = sim->y_max / 2;
+}
+
+#endif
@@ -0,0 +1,407 @@
+/*
+ * Host tests for the pure parts of motors-daemon: the motion planner, the
+ * position journal and the grid scan order. Nothing here needs the camera,
+ * the kernel module or a running daemon.
+ *
+ *   make test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "motor-planner.h"
+#include "motor-journal.h"
+
+int checks = 0;
+int failures = 0;
+
+#define CHECK(cond, ...) \
+  do { \
+    checks++; \
+    if (!(cond)) { \
+      failures++; \
+      printf("FAIL %s:%d: %s: ", __FILE__, __LINE__, #cond); \
+      printf(__VA_ARGS__); \
+      printf("\n"); \
+    } \
+  } while (0)
+
+struct planner_config config(int ax, int ay, int start_speed, int interp_steps)
+{
+  struct planner_config cfg = { { ax, ax }, { ay, ay }, start_speed, interp_steps };
+  return cfg;
+}
+
+int plan_peak(const struct motor_segment *segs, int n)
+{
+  int i, peak = 0;
+
+  for (i = 0; i < n; i++)
+    if (segs[i].speed > peak)
+      peak = segs[i].speed;
+  return peak;
+}
+
+/*
+ * What every plan has to hold: the segments add up to the move, stay within
+ * the requested and start speeds, and never run faster than the ramp allows
+ * at that point of the move, from either end.
+ */
+void check_plan(const struct planner_config *cfg, int dx, int dy, int speed)
+{
+  struct motor_segment segs[PLANNER_MAX_SEGMENTS];
+  int n = planner_plan(cfg, dx, dy, speed, segs, PLANNER_MAX_SEGMENTS);
+  int adx = planner_abs(dx), ady = planner_abs(dy);
+  int dist = adx > ady ? adx : ady;
+  int accel = planner_limit(cfg->x.accel, adx != 0, cfg->y.accel, ady != 0);
+  int decel = planner_limit(cfg->x.decel, adx != 0, cfg->y.decel, ady != 0);
+  long long v0 = cfg->start_speed > 0 && cfg->start_speed < speed ? cfg->start_speed : speed;
+  int sumx = 0, sumy = 0, pos = 0, i;
+
+  CHECK(n >= 1 && n <= PLANNER_MAX_SEGMENTS, "move %d,%d gave %d segments", dx, dy, n);
+  for (i = 0; i < n; i++) {
+    long long v = segs[i].speed;
+    int major = planner_major(&segs[i]);
+
+    CHECK(major > 0, "move %d,%d segment %d is empty", dx, dy, i);
+    CHECK(v >= v0 && v <= speed, "move %d,%d segment %d at speed %lld", dx, dy, i, v);
+    CHECK(dx == 0 || segs[i].x == 0 || (segs[i].x < 0) == (dx < 0), "move %d,%d segment %d goes back", dx, dy, i);
+    CHECK(dy == 0 || segs[i].y == 0 || (segs[i].y < 0) == (dy < 0), "move %d,%d segment %d goes back", dx, dy, i);
+    // a step of slack for the integer ramp distances
+    if (accel > 0)
+      CHECK(v * v <= v0 * v0 + 2LL * accel * (pos + 1), "move %d,%d segment %d at %lld after %d steps",
+            dx, dy, i, v, pos);
+    if (decel > 0)
+      CHECK(v * v <= v0 * v0 + 2LL * decel * (dist - pos - major + 1), "move %d,%d segment %d at %lld %d steps before the end",
+            dx, dy, i, v, dist - pos - major);
+    sumx += segs[i].x;
+    sumy += segs[i].y;
+    pos += major;
+  }
+  CHECK(sumx == dx && sumy == dy, "move %d,%d adds up to %d,%d", dx, dy, sumx, sumy);
+  CHECK(pos == dist, "move %d,%d runs %d major steps", dx, dy, pos);
+
+  // interpolated, the axes stay within a step of the straight line
+  if (cfg->interp_steps > 0) {
+    sumx = sumy = pos = 0;
+    for (i = 0; i < n; i++) {
+      sumx += segs[i].x;
+      sumy += segs[i].y;
+      pos += planner_major(&segs[i]);
+      CHECK(planner_abs(sumx - planner_lerp(dx, pos, dist)) <= 1 && planner_abs(sumy - planner_lerp(dy, pos, dist)) <= 1,
+            "move %d,%d leaves the line at %d,%d", dx, dy, sumx, sumy);
+    }
+  }
+}
+
+void test_plan_sums()
+{
+  static const int moves[][2] = {
+    { 1, 0 }, { 0, 1 }, { -1, -1 }, { 7, 3 }, { 100, 0 }, { 0, -100 }, { 965, -400 },
+    { -2130, 1600 }, { 2130, 2130 }, { 3, 2000 }, { -1999, 1 }, { 40000, -123 },
+  };
+  static const int speeds[] = { 100, 450, 900 };
+  struct planner_config cfgs[] = {
+    config(0, 0, 100, 0),
+    config(3000, 3000, 200, 0),
+    config(3000, 3000, 200, 40),
+    config(500, 8000, 50, 0),
+    config(8000, 500, 50, 7),
+    config(3000, 0, 100, 0),
+  };
+  size_t m, s, c;
+
+  cfgs[5].x.decel = 0;
+  cfgs[5].y.decel = 20000;
+  for (c = 0; c < sizeof(cfgs) / sizeof(cfgs[0]); c++)
+    for (m = 0; m < sizeof(moves) / sizeof(moves[0]); m++)
+      for (s = 0; s < sizeof(speeds) / sizeof(speeds[0]); s++)
+        check_plan(&cfgs[c], moves[m][0], moves[m][1], speeds[s]);
+}
+
+void test_plan_shapes()
+{
+  struct planner_config cfg = config(3000, 3000, 200, 0);
+  struct motor_segment segs[PLANNER_MAX_SEGMENTS];
+  int n, i, peak;
+
+  // nothing to move
+  CHECK(planner_plan(&cfg, 0, 0, 900, segs, PLANNER_MAX_SEGMENTS) == 0, "empty move planned");
+
+  // no acceleration, one segment at the requested speed
+  cfg = config(0, 0, 200, 0);
+  n = planner_plan(&cfg, 500, -300, 700, segs, PLANNER_MAX_SEGMENTS);
+  CHECK(n == 1 && segs[0].x == 500 && segs[0].y == -300 && segs[0].speed == 700,
+        "unramped move gave %d segments", n);
+
+  // long enough to reach cruise: up from and down to the start speed, the cruise in between
+  cfg = config(3000, 3000, 200, 0);
+  n = planner_plan(&cfg, 2000, 0, 900, segs, PLANNER_MAX_SEGMENTS);
+  CHECK(n == 2 * PLANNER_RAMP_STEPS + 1, "long move gave %d segments", n);
+  CHECK(segs[0].speed == 200 && segs[n - 1].speed == 200, "long move starts at %d, ends at %d",
+        segs[0].speed, segs[n - 1].speed);
+  CHECK(plan_peak(segs, n) == 900, "long move peaks at %d", plan_peak(segs, n));
+  for (i = 1; i < n; i++)
+    CHECK(i <= PLANNER_RAMP_STEPS ? segs[i].speed > segs[i - 1].speed : segs[i].speed < segs[i - 1].speed,
+          "long move segment %d at %d after %d", i, segs[i].speed, segs[i - 1].speed);
+
+  // too short to reach cruise: a triangle with its peak where the ramps meet
+  n = planner_plan(&cfg, 60, 0, 900, segs, PLANNER_MAX_SEGMENTS);
+  peak = plan_peak(segs, n);
+  CHECK(peak < 900 && (long long) peak * peak <= 200LL * 200 + 3000LL * 60, "short move peaks at %d", peak);
+  CHECK(peak > 200, "short move does not ramp at all");
+
+  // one axis, the other stays put
+  n = planner_plan(&cfg, 0, -1200, 900, segs, PLANNER_MAX_SEGMENTS);
+  for (i = 0; i < n; i++)
+    CHECK(segs[i].x == 0 && segs[i].y < 0, "Y move segment %d is %d,%d", i, segs[i].x, segs[i].y);
+
+  // a single step cannot ramp
+  n = planner_plan(&cfg, 1, 0, 900, segs, PLANNER_MAX_SEGMENTS);
+  CHECK(n == 1 && segs[0].x == 1, "single step gave %d segments", n);
+
+  // start speed above the requested speed runs at the requested one
+  n = planner_plan(&cfg, 1000, 0, 150, segs, PLANNER_MAX_SEGMENTS);
+  CHECK(n == 1 && segs[0].speed == 150, "slow move gave %d segments at %d", n, segs[0].speed);
+
+  // too few segments to ramp into, still one segment for the whole move
+  n = planner_plan(&cfg, 1000, 10, 900, segs, 4);
+  CHECK(n == 1 && segs[0].x == 1000 && segs[0].y == 10, "short segment list gave %d segments", n);
+}
+
+/* the plan is limited by the axes that move, not by one that stands still */
+void test_plan_axis_limits()
+{
+  struct planner_config cfg = config(500, 8000, 100, 0);
+  struct planner_config only_y = config(8000, 8000, 100, 0);
+  struct planner_config only_x = config(500, 500, 100, 0);
+  struct motor_segment a[PLANNER_MAX_SEGMENTS], b[PLANNER_MAX_SEGMENTS];
+  int na, nb, i;
+
+  CHECK(planner_limit(500, true, 8000, true) == 500, "both axes");
+  CHECK(planner_limit(500, false, 8000, true) == 8000, "Y only");
+  CHECK(planner_limit(0, true, 8000, true) == 8000, "unlimited X");
+  CHECK(planner_limit(0, true, 0, true) == 0, "no limit");
+
+  na = planner_plan(&cfg, 0, 600, 900, a, PLANNER_MAX_SEGMENTS);
+  nb = planner_plan(&only_y, 0, 600, 900, b, PLANNER_MAX_SEGMENTS);
+  CHECK(na == nb, "Y move ramps like Y alone, %d and %d segments", na, nb);
+  for (i = 0; i < na && i < nb; i++)
+    CHECK(a[i].y == b[i].y && a[i].speed == b[i].speed, "Y move segment %d", i);
+
+  na = planner_plan(&cfg, 300, 600, 900, a, PLANNER_MAX_SEGMENTS);
+  nb = planner_plan(&only_x, 300, 600, 900, b, PLANNER_MAX_SEGMENTS);
+  CHECK(na == nb, "diagonal ramps at the X limit, %d and %d segments", na, nb);
+  for (i = 0; i < na && i < nb; i++)
+    CHECK(a[i].y == b[i].y && a[i].speed == b[i].speed, "diagonal segment %d", i);
+  CHECK(plan_peak(a, na) < 900, "diagonal at the X limit reaches %d in 600 steps", plan_peak(a, na));
+}
+
+void test_chunks()
+{
+  static const struct motor_segment segs[] = {
+    { 100, 0, 900 }, { -37, 15, 400 }, { 3, -1000, 200 }, { 1, 1, 100 }, { 640, 640, 900 },
+  };
+  static const int sizes[] = { 0, 1, 7, 40, 1000 };
+  size_t s, c;
+
+  for (s = 0; s < sizeof(segs) / sizeof(segs[0]); s++) {
+    for (c = 0; c < sizeof(sizes) / sizeof(sizes[0]); c++) {
+      const struct motor_segment *seg = &segs[s];
+      int major = planner_major(seg), done = 0, x = 0, y = 0, pieces = 0;
+
+      while (done < major && pieces <= major) {
+        struct motor_segment sub = planner_chunk(seg, done, sizes[c]);
+        int len = planner_major(&sub);
+
+        CHECK(len > 0 && (sizes[c] == 0 || len <= sizes[c]), "chunk of %d after %d is %d long", sizes[c], done, len);
+        CHECK(sub.speed == seg->speed, "chunk speed %d", sub.speed);
+        done += len;
+        x += sub.x;
+        y += sub.y;
+        pieces++;
+        CHECK(planner_abs(x - planner_lerp(seg->x, done, major)) <= 1 &&
+              planner_abs(y - planner_lerp(seg->y, done, major)) <= 1,
+              "segment %d,%d leaves the line at %d,%d", seg->x, seg->y, x, y);
+      }
+      CHECK(x == seg->x && y == seg->y, "chunks of %d of %d,%d add up to %d,%d", sizes[c], seg->x, seg->y, x, y);
+      CHECK(sizes[c] != 0 || pieces == 1, "whole segment came in %d pieces", pieces);
+    }
+  }
+}
+
+void test_segment_ms()
+{
+  struct motor_segment seg = { 900, 10, 900 };
+
+  CHECK(planner_segment_ms(&seg) == 1000, "900 steps at 900");
+  seg.x = -450;
+  seg.y = 900;
+  seg.speed = 450;
+  CHECK(planner_segment_ms(&seg) == 2000, "900 Y steps at 450");
+  seg.x = 1;
+  seg.y = 0;
+  seg.speed = 5000;
+  CHECK(planner_segment_ms(&seg) == 1, "a step takes at least 1 ms");
+  seg.x = 0;
+  CHECK(planner_segment_ms(&seg) == 1, "an empty segment");
+  seg.x = 100;
+  seg.speed = 0;
+  CHECK(planner_segment_ms(&seg) == 1, "speed 0");
+}
+
+struct motor_journal_record record(int x, int y)
+{
+  struct motor_journal_record rec;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.x = x;
+  rec.y = y;
+  rec.x_max_steps = 2130;
+  rec.y_max_steps = 1600;
+  return rec;
+}
+
+void test_journal()
+{
+  struct motor_journal journal;
+  struct motor_journal_record rec, other;
+  const struct motor_journal_record *latest;
+
+  CHECK(motor_journal_crc("123456789", 9) == 0xcbf43926, "CRC-32 check value %#x", motor_journal_crc("123456789", 9));
+  CHECK(motor_journal_crc("", 0) == 0, "CRC-32 of nothing");
+
+  memset(&journal, 0, sizeof(journal));
+  CHECK(motor_journal_latest(&journal) == NULL, "empty journal has a record");
+
+  // writes alternate between the slots, the newest wins
+  rec = record(10, 20);
+  motor_journal_write(&journal, &rec);
+  CHECK(journal.slot[0].seq == 1 && motor_journal_latest(&journal) == &journal.slot[0], "first write");
+  rec = record(30, 40);
+  motor_journal_write(&journal, &rec);
+  CHECK(journal.slot[1].seq == 2 && motor_journal_latest(&journal) == &journal.slot[1], "second write");
+  rec = record(50, 60);
+  motor_journal_write(&journal, &rec);
+  latest = motor_journal_latest(&journal);
+  CHECK(latest == &journal.slot[0] && latest->seq == 3 && latest->x == 50, "third write");
+
+  // a torn newest record leaves the older one, and the next write goes over the torn one
+  journal.slot[0].y ^= 1;
+  latest = motor_journal_latest(&journal);
+  CHECK(latest == &journal.slot[1] && latest->x == 30, "torn record is used");
+  rec = record(70, 80);
+  motor_journal_write(&journal, &rec);
+  CHECK(journal.slot[0].seq == 3 && motor_journal_latest(&journal) == &journal.slot[0], "write over the torn record");
+
+  journal.slot[0].magic = 0;
+  journal.slot[1].crc ^= 1;
+  CHECK(motor_journal_latest(&journal) == NULL, "two bad records");
+
+  // the sequence number wraps
+  memset(&journal, 0, sizeof(journal));
+  rec = record(1, 1);
+  motor_journal_write(&journal, &rec);
+  journal.slot[0].seq = 0xffffffff;
+  journal.slot[0].crc = motor_journal_crc(&journal.slot[0], offsetof(struct motor_journal_record, crc));
+  rec = record(2, 2);
+  motor_journal_write(&journal, &rec);
+  latest = motor_journal_latest(&journal);
+  CHECK(latest == &journal.slot[1] && latest->seq == 0 && latest->x == 2, "sequence wrap");
+
+  rec = record(5, 5);
+  other = rec;
+  other.seq = 9;
+  other.crc = 1;
+  CHECK(motor_journal_same(&rec, &other), "seq and crc are not state");
+  other.moving = 1;
+  CHECK(!motor_journal_same(&rec, &other), "moving is state");
+}
+
+#define SCAN_MAX 256
+
+int scan(int x_min, int y_min, int x_max, int y_max, int x_step, int y_step, int from_x, int from_y,
+         int *px, int *py)
+{
+  return planner_scan(x_min, y_min, x_max, y_max, x_step, y_step, from_x, from_y, px, py, SCAN_MAX);
+}
+
+/* every grid point once, each point one grid step from the last along one axis */
+void check_scan(int x_min, int y_min, int x_max, int y_max, int x_step, int y_step, int from_x, int from_y)
+{
+  int px[SCAN_MAX], py[SCAN_MAX];
+  int n = scan(x_min, y_min, x_max, y_max, x_step, y_step, from_x, from_y, px, py);
+  int nx = planner_scan_count(x_min, x_max, x_step), ny = planner_scan_count(y_min, y_max, y_step);
+  int i, j;
+
+  CHECK(n == nx * ny, "scan of %d x %d points gave %d", nx, ny, n);
+  for (i = 0; i < n; i++) {
+    CHECK(px[i] >= x_min && px[i] <= x_max && py[i] >= y_min && py[i] <= y_max, "point %d,%d outside", px[i], py[i]);
+    for (j = 0; j < i; j++)
+      CHECK(px[i] != px[j] || py[i] != py[j], "point %d,%d visited twice", px[i], py[i]);
+    if (i > 0)
+      CHECK((px[i] == px[i - 1] && planner_abs(py[i] - py[i - 1]) <= y_step) ||
+            (py[i] == py[i - 1] && planner_abs(px[i] - px[i - 1]) <= x_step),
+            "jump from %d,%d to %d,%d", px[i - 1], py[i - 1], px[i], py[i]);
+  }
+}
+
+void test_scan()
+{
+  static const int rows[][2] = {
+    { 0, 0 }, { 5, 0 }, { 10, 0 }, { 10, 5 }, { 5, 5 }, { 0, 5 }, { 0, 10 }, { 5, 10 }, { 10, 10 },
+  };
+  int px[SCAN_MAX], py[SCAN_MAX];
+  int n, i;
+
+  // rows along X from the corner the motor is at
+  n = scan(0, 0, 10, 10, 5, 5, 1, 2, px, py);
+  CHECK(n == 9, "3 x 3 grid gave %d points", n);
+  for (i = 0; i < n && i < 9; i++)
+    CHECK(px[i] == rows[i][0] && py[i] == rows[i][1], "point %d is %d,%d", i, px[i], py[i]);
+
+  // from the far corner the scan starts there
+  n = scan(0, 0, 10, 10, 5, 5, 9, 9, px, py);
+  CHECK(n == 9 && px[0] == 10 && py[0] == 10 && px[8] == 0 && py[8] == 0, "far corner start %d,%d", px[0], py[0]);
+  n = scan(0, 0, 10, 10, 5, 5, 9, 1, px, py);
+  CHECK(n == 9 && px[0] == 10 && py[0] == 0 && px[1] == 5, "X end start %d,%d", px[0], py[0]);
+
+  // a tall box with many rows is swept in columns along Y
+  n = scan(0, 0, 10, 100, 10, 5, 0, 0, px, py);
+  CHECK(n == 42, "tall grid gave %d points", n);
+  CHECK(px[0] == 0 && py[0] == 0 && px[20] == 0 && py[20] == 100 && px[21] == 10 && py[21] == 100 && px[41] == 10 && py[41] == 0,
+        "tall grid runs %d,%d %d,%d %d,%d", px[0], py[0], px[20], py[20], px[21], py[21]);
+
+  // the far edge is a point even when the step does not land on it
+  n = scan(0, 0, 11, 0, 5, 5, 0, 0, px, py);
+  CHECK(n == 4 && px[0] == 0 && px[1] == 5 && px[2] == 10 && px[3] == 11, "uneven row gave %d points", n);
+  n = scan(3, 3, 3, 3, 5, 5, 0, 0, px, py);
+  CHECK(n == 1 && px[0] == 3 && py[0] == 3, "single point grid");
+
+  CHECK(scan(0, 0, 10, 10, 0, 5, 0, 0, px, py) == -1, "zero step");
+  CHECK(scan(0, 0, 10, -1, 5, 5, 0, 0, px, py) == -1, "inverted box");
+  CHECK(scan(0, 0, 2130, 1600, 10, 10, 0, 0, px, py) == -1, "too many points");
+  CHECK(scan(-2147483647, 0, 2147483647, 0, 1, 1, 0, 0, px, py) == -1, "huge axis");
+
+  check_scan(0, 0, 2130, 1600, 200, 200, 1065, 800);
+  check_scan(0, 0, 2130, 1600, 300, 150, 2130, 0);
+  check_scan(100, 700, 900, 720, 50, 7, 0, 1600);
+  check_scan(0, 0, 100, 2000, 25, 100, 60, 1900);
+}
+
+int main()
+{
+  test_plan_sums();
+  test_plan_shapes();
+  test_plan_axis_limits();
+  test_chunks();
+  test_segment_ms();
+  test_journal();
+  test_scan();
+
+  printf("%d checks, %d failed\n", checks, failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,230 @@
+#ifndef MOTOR_TRACE_H
+#define MOTOR_TRACE_H
+
+/*
+ * Binary trace of what motors-daemon does, kept instead of debug syslog.
+ *
+ * Trace points write fixed size records into a ring in the daemon's memory:
+ * an event number, a CLOCK_MONOTONIC stamp and four integers, no formatting
+ * and no syscall besides reading the clock. Events belong to categories that
+ * can be left out at compile time with MOTOR_TRACE_COMPILED and switched off
+ * at run time with the daemon's -f option or a 'X' 'f' request.
+ *
+ * The daemon writes the ring to a dump file when asked with 'X' 'd' or
+ * SIGUSR1, and when it crashes. A dump is a struct motor_trace_header
+ * followed by the ring's records in slot order; motor_trace_format() turns a
+ * record back into text.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MOTOR_TRACE_PATH "/dev/shm/motors-trace"
+#define MOTOR_TRACE_MAGIC 0x43525454 // "TTRC"
+#define MOTOR_TRACE_VERSION 1
+
+/* categories, bit numbers in a trace mask */
+#define MOTOR_TRACE_REQUEST 0       // requests handled by the I/O thread and their replies
+#define MOTOR_TRACE_CLIENT 1        // connections
+#define MOTOR_TRACE_CONTROL 2       // commands and moves on the control thread
+#define MOTOR_TRACE_IOCTL 3         // driver calls
+#define MOTOR_TRACE_ROUTE 4         // tours and scans
+#define MOTOR_TRACE_CATEGORIES 5
+
+#define MOTOR_TRACE_ALL ((1u << MOTOR_TRACE_CATEGORIES) - 1)
+
+/* trace points built into the daemon, all unless set on the compiler command line */
+#ifndef MOTOR_TRACE_COMPILED
+#define MOTOR_TRACE_COMPILED MOTOR_TRACE_ALL
+#endif
+
+#define MOTOR_TRACE_EVENT(category, n) ((category) << 8 | (n))
+#define MOTOR_TRACE_BIT(event) (1u << ((event) >> 8))
+
+/* events, with what their arguments hold */
+enum motor_trace_event
+{
+  TRACE_REQUEST = MOTOR_TRACE_EVENT(MOTOR_TRACE_REQUEST, 0),    // id, command | type << 8, x, y
+  TRACE_REPLY,                                                  // id, status, length, fd
+  TRACE_PRESET,                                                 // id, x, y
+  TRACE_ACCEPT = MOTOR_TRACE_EVENT(MOTOR_TRACE_CLIENT, 0),      // fd, clients
+  TRACE_CLOSE,                                                  // fd, bytes of a partial request
+  TRACE_BAD_FRAME,                                              // fd
+  TRACE_READ_ERROR,                                             // fd, errno
+  TRACE_TIMEOUT,                                                // fd
+  TRACE_OVERFLOW,                                               // fd, frame length
+  TRACE_ACCEPT_ERROR,                                           // errno
+  TRACE_COMMAND = MOTOR_TRACE_EVENT(MOTOR_TRACE_CONTROL, 0),    // command | type << 8, x, y, speed
+  TRACE_DROPPED,                                                // command | type << 8
+  TRACE_QUEUE,                                                  // x, y, speed, relative
+  TRACE_MERGED,                                                 // requests
+  TRACE_MOVE,                                                   // from x, y, to x, y
+  TRACE_PLAN,                                                   // speed, segments, deferred
+  TRACE_SEGMENT,                                                // x, y, speed, segment
+  TRACE_VELOCITY,                                               // x, y steps/s
+  TRACE_DEADMAN,                                                // ms
+  TRACE_TRACK,                                                  // target x, y, aim x, y
+  TRACE_IOCTL = MOTOR_TRACE_EVENT(MOTOR_TRACE_IOCTL, 0),        // command, us
+  TRACE_ROUTE = MOTOR_TRACE_EVENT(MOTOR_TRACE_ROUTE, 0),        // kind, points, loop
+  TRACE_SCAN,                                                   // x points, y points, x, y
+  TRACE_ROUTE_POINT,                                            // point, x, y
+  TRACE_ROUTE_PAUSED,                                           // kind, point
+  TRACE_ROUTE_DONE,                                             // kind
+};
+
+struct motor_trace_record
+{
+  atomic_uint seq;              // position in the trace + 1, 0 while being written
+  uint16_t event;               // enum motor_trace_event
+  uint16_t reserved;
+  uint64_t stamp_us;            // CLOCK_MONOTONIC
+  int32_t arg[4];
+};
+
+struct motor_trace_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;         // sizeof(struct motor_trace_record)
+  uint32_t records;             // slots in the ring
+  uint32_t written;             // records written since start, the newest is written - 1
+  uint32_t mask;                // categories traced at the time of the dump
+  uint64_t started_us;          // CLOCK_MONOTONIC the daemon started at
+  int32_t pid;
+  int32_t signal;               // that made the daemon dump, 0 when asked to
+};
+
+static const char *const motor_trace_categories[MOTOR_TRACE_CATEGORIES] = {
+  "request", "client", "control", "ioctl", "route"
+};
+
+/*
+ * Mask for a comma separated list of category names, "all" or "none".
+ * Returns -1 on an unknown name.
+ */
+static inline long motor_trace_parse_mask(const char *list)
+{
+  long mask = 0;
+  int i;
+
+  while (*list) {
+    size_t len = strcspn(list, ",");
+    if (len == 3 && strncmp(list, "all", 3) == 0)
+      mask = MOTOR_TRACE_ALL;
+    else if (!(len == 4 && strncmp(list, "none", 4) == 0)) {
+      for (i = 0; i < MOTOR_TRACE_CATEGORIES; i++)
+        if (strlen(motor_trace_categories[i]) == len && strncmp(list, motor_trace_categories[i], len) == 0)
+          break;
+      if (i == MOTOR_TRACE_CATEGORIES)
+        return -1;
+      mask |= 1u << i;
+    }
+    list += len;
+    if (*list == ',')
+      list++;
+  }
+  return mask;
+}
+
+static inline char motor_trace_char(int32_t c)
+{
+  return c > ' ' && c < 0x7f ? (char) c : '-';
+}
+
+/* a record as one line of text, without the time stamp */
+static inline void motor_trace_format(const struct motor_trace_record *r, char *buf, size_t size)
+{
+  static const char *const ioctls[] = { "?", "STOP", "RESET", "MOVE", "GET_STATUS", "SPEED", "GOBACK", "CRUISE" };
+  const int32_t *a = r->arg;
+
+  switch (r->event) {
+  case TRACE_REQUEST:
+    snprintf(buf, size, "request %u %c%c x %d y %d", (uint32_t) a[0],
+             motor_trace_char(a[1] & 0xff), motor_trace_char(a[1] >> 8 & 0xff), a[2], a[3]);
+    break;
+  case TRACE_REPLY:
+    snprintf(buf, size, "reply %u status %d, %d bytes to fd %d", (uint32_t) a[0], a[1], a[2], a[3]);
+    break;
+  case TRACE_PRESET:
+    snprintf(buf, size, "preset %d set to X %d, Y %d", a[0], a[1], a[2]);
+    break;
+  case TRACE_ACCEPT:
+    snprintf(buf, size, "accept fd %d, %d clients", a[0], a[1]);
+    break;
+  case TRACE_CLOSE:
+    snprintf(buf, size, "close fd %d%s", a[0], a[1] ? ", dropping a partial request" : "");
+    break;
+  case TRACE_BAD_FRAME:
+    snprintf(buf, size, "bad frame from fd %d, closing", a[0]);
+    break;
+  case TRACE_READ_ERROR:
+    snprintf(buf, size, "read failed on fd %d, errno %d", a[0], a[1]);
+    break;
+  case TRACE_TIMEOUT:
+    snprintf(buf, size, "fd %d timed out", a[0]);
+    break;
+  case TRACE_OVERFLOW:
+    snprintf(buf, size, "reply overflow on fd %d, dropping %d bytes", a[0], a[1]);
+    break;
+  case TRACE_ACCEPT_ERROR:
+    snprintf(buf, size, "accept failed, errno %d", a[0]);
+    break;
+  case TRACE_COMMAND:
+    snprintf(buf, size, "command %c%c x %d y %d speed %d",
+             motor_trace_char(a[0] & 0xff), motor_trace_char(a[0] >> 8 & 0xff), a[1], a[2], a[3]);
+    break;
+  case TRACE_DROPPED:
+    snprintf(buf, size, "dropping command %c%c queued before a stop",
+             motor_trace_char(a[0] & 0xff), motor_trace_char(a[0] >> 8 & 0xff));
+    break;
+  case TRACE_QUEUE:
+    snprintf(buf, size, "queue %s move X %d, Y %d, speed %d", a[3] ? "relative" : "absolute", a[0], a[1], a[2]);
+    break;
+  case TRACE_MERGED:
+    snprintf(buf, size, "merged %d move requests into one", a[0]);
+    break;
+  case TRACE_MOVE:
+    snprintf(buf, size, "move from X %d, Y %d to X %d, Y %d", a[0], a[1], a[2], a[3]);
+    break;
+  case TRACE_PLAN:
+    snprintf(buf, size, "plan at speed %d, %d segments%s", a[0], a[1], a[2] ? ", after the running piece" : "");
+    break;
+  case TRACE_SEGMENT:
+    snprintf(buf, size, "segment %d, X %d, Y %d, speed %d", a[3], a[0], a[1], a[2]);
+    break;
+  case TRACE_VELOCITY:
+    snprintf(buf, size, "velocity mode X %d, Y %d steps/s", a[0], a[1]);
+    break;
+  case TRACE_DEADMAN:
+    snprintf(buf, size, "velocity not refreshed for %d ms, stopping", a[0]);
+    break;
+  case TRACE_TRACK:
+    snprintf(buf, size, "tracking target X %d, Y %d, moving to X %d, Y %d", a[0], a[1], a[2], a[3]);
+    break;
+  case TRACE_IOCTL:
+    snprintf(buf, size, "ioctl %s, %d us", a[0] >= 1 && a[0] <= 7 ? ioctls[a[0]] : ioctls[0], a[1]);
+    break;
+  case TRACE_ROUTE:
+    snprintf(buf, size, "route %c of %d points%s", motor_trace_char(a[0]), a[1], a[2] ? ", looping" : "");
+    break;
+  case TRACE_SCAN:
+    snprintf(buf, size, "scan of %d x %d points from X %d, Y %d", a[0], a[1], a[2], a[3]);
+    break;
+  case TRACE_ROUTE_POINT:
+    snprintf(buf, size, "route to point %d, X %d, Y %d", a[0], a[1], a[2]);
+    break;
+  case TRACE_ROUTE_PAUSED:
+    snprintf(buf, size, "route %c paused at point %d by a client move", motor_trace_char(a[0]), a[1]);
+    break;
+  case TRACE_ROUTE_DONE:
+    snprintf(buf, size, "route %c done", motor_trace_char(a[0]));
+    break;
+  default:
+    snprintf(buf, size, "event %#x %d %d %d %d", r->event, a[0], a[1], a[2], a[3]);
+    break;
+  }
+}
+
+#endif
@@ -12,46 +12,48 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
 #include <string.h>
 #include <syslog.h>
 #include <signal.h>
+#include <time.h>
 
-#define SV_SOCK_PATH "/dev/md"
-#define BUF_SIZE 15
+#include "motor-shm.h"
+#include "motor-protocol.h"
+#include "motor-client.h"
+#include "motor-trace.h"
 
-#define PID_SIZE 32
+#define BUF_SIZE 15
 
 #define MOTOR_INVERT_X 0x1
 #define MOTOR_INVERT_Y 0x2
 #define MOTOR_INVERT_BOTH 0x3
 
-enum motor_status
+/* any answer the daemon may send back */
+union reply
 {
-  MOTOR_IS_STOP,
-  MOTOR_IS_RUNNING,
-};
-
-struct request{
-    char command; // d,r,s,p,b,S,i,j (move, reset,set speed,get position, is busy,Status,initial,JSON)
-    char type;   // g,h,c,s (absolute,relative,cruise,stop)
-    int x;
-    int got_x;
-    int y;
-    int got_y;
-    int speed;  // Add speed to the request structure
-    bool speed_supplied; // Track if speed was supplied
+  struct motor_message msg;
+  struct motor_status_reply status; // msg with the estimated position after it
+  struct daemon_counters counters;
+  struct motor_preset presets[MOTOR_MAX_PRESETS];
+  struct motor_route_status route;
+  struct motor_arrival arrival;
+  struct {
+    struct motor_metrics m;
+    struct motor_command_metrics commands[MOTOR_METRICS_MAX_COMMANDS];
+  } metrics;
+  struct motor_trace_info trace;
 };
 
-struct motor_message
+/* what goes out with a request besides struct request itself */
+struct request_extra
 {
-  int x;
-  int y;
-  enum motor_status status;
-  int speed;
-  /* these two members are not standard from the original kernel module */
-  unsigned int x_max_steps;
-  unsigned int y_max_steps;
-  unsigned int inversion_state; // Report the inversion state
+  uint16_t flags;               // MOTOR_FLAG_* for the frame header
+  struct motor_preset preset;   // sent after the request for 'P'
+  int nwaypoints;               // sent after the request for 'T' 's'
+  struct motor_waypoint waypoints[MOTOR_MAX_WAYPOINTS];
+  struct motor_scan scan;       // sent after the request for 'T' 'g'
+  const char *trace_file;       // dump to decode for 'Y', which stays local
 };
 
 void JSON_initial(struct motor_message *message)
@@ -96,6 +98,46 @@ void JSON_status(struct motor_message *message)
   printf("\n");
 }
 
+void JSON_estimate(struct motor_status_reply *reply)
+{
+  // the position the daemon expects the motor at by now, between status reads
+  printf("{");
+  printf("\"status\":\"%d\"", reply->msg.status);
+  printf(",");
+  printf("\"xpos\":\"%d\"", reply->msg.x);
+  printf(",");
+  printf("\"ypos\":\"%d\"", reply->msg.y);
+  printf(",");
+  printf("\"xest\":\"%d\"", reply->estimate.x);
+  printf(",");
+  printf("\"yest\":\"%d\"", reply->estimate.y);
+  printf(",");
+  printf("\"age\":\"%u\"", reply->estimate.age_ms);
+  printf("}");
+  printf("\n");
+}
+
+// an event pushed to a subscriber, as one json line
+void JSON_event(struct motor_frame *hdr, union reply *reply)
+{
+  if (hdr->flags != MOTOR_EVENT_ARRIVED) {
+    JSON_status(&reply->msg);
+    return;
+  }
+  printf("{");
+  printf("\"event\":\"arrived\"");
+  printf(",");
+  printf("\"point\":\"%d\"", reply->arrival.route.pos + 1);
+  printf(",");
+  printf("\"points\":\"%d\"", reply->arrival.route.len);
+  printf(",");
+  printf("\"xpos\":\"%d\"", reply->arrival.x);
+  printf(",");
+  printf("\"ypos\":\"%d\"", reply->arrival.y);
+  printf("}");
+  printf("\n");
+}
+
 void xy_pos(struct motor_message *message)
 {
   printf("%d,%d\n", (*message).x, (*message).y);
@@ -105,7 +147,7 @@ void show_status(struct motor_message *message)
 {
   printf("Max X Steps %d.\n", (*message).x_max_steps);
   printf("Max Y Steps %d.\n", (*message).y_max_steps);
-  printf("Status Move: %d.\n", (*message).status);
+  printf("Status Move: %d%s.\n", (*message).status, message->status == MOTOR_IS_HOMING ? " (homing)" : "");
   printf("X Steps %d.\n", (*message).x);
   printf("Y Steps %d.\n",(*message).y);
   printf("Speed %d.\n", (*message).speed);
@@ -122,37 +164,10 @@ void show_status(struct motor_message *message)
   }
 }
 
-int check_daemon(char *file_name)
-{
-    FILE *f;
-    long pid;
-    char pid_buffer[PID_SIZE];
-
-    f = fopen(file_name, "r");
-    if(f == NULL)
-        return 0;
-
-    if (fgets(pid_buffer, PID_SIZE, f) == NULL) {
-        fclose(f);
-        return 0;
-    }
-    fclose(f);
-
-    if (sscanf(pid_buffer, "%ld", &pid) != 1) {
-        return 0;
-    }
-
-    if (kill(pid, 0) == 0) {
-        return 1;
-    }
-
-    return 0;
-}
-
 void print_request_message(struct request *req)
 {
-    printf("Sent message: command=%c, type=%c, x=%d, y=%d, speed=%d, speed_supplied=%d\n",
-           req->command, req->type, req->x, req->y, req->speed, req->speed_supplied);
+    printf("Sent message: command=%c, type=%c, x=%d, y=%d, speed=%d, wait=%d\n",
+           req->command, req->type, req->x, req->y, req->speed, req->wait);
 }
 
 void initialize_request_message(struct request *req) {
@@ -164,223 +179,829 @@ void initialize_request_message(struct request *req) {
     req->y = 0;
     req->got_y = 0;
     req->speed = 0;
-    req->speed_supplied = false;
+    req->wait = 0;
 }
 
-int main(int argc, char *argv[])
+void usage(char *progname)
 {
-  char direction = '\0';
-  int stepspeed = 900;
-  int c;
-  char *daemon_pid_file;
-  struct request request_message;
-  bool verbose = false; // Initialize verbose to false
+  printf("Usage : %s\n"
+         "\t -d Direction step\n"
+         "\t -s Speed step (default 900)\n"
+         "\t -x X position/step (default 0)\n"
+         "\t -y Y position/step (default 0) .\n"
+         "\t -r reset to default pos.\n"
+         "\t -v verbose mode, prints debugging information while app is running\n"
+         "\t -j return json string xpos,ypos,status.\n"
+         "\t -e return json string with the last read and the estimated position,\n"
+         "\t    and the age in ms of the estimate\n"
+         "\t -i return json string for all camera parameters\n"
+         "\t -p return xpos,ypos as a string\n"
+         "\t -b prints 1 if motor is (b)usy moving or 0 if is not\n"
+         "\t -S show status\n"
+         "\t -I Invert motor direction with 'x', 'y', or 'b' for both axes\n"
+         "\t -C show daemon counters, status ioctls saved and move requests merged\n"
+         "\t -m show daemon metrics, request, socket and driver call latencies and connection\n"
+         "\t    and queue figures\n"
+         "\t -M the same as one json line, with the histogram buckets\n"
+         "\t -X dump the daemon's trace of recent requests, moves and driver calls and print it\n"
+         "\t -Y file print a trace dump, such as the one left by a crash\n"
+         "\t -F list trace only these categories of request,client,control,ioctl,route, all or none\n"
+         "\t -w ms wait until the motor is idle, with -d wait for the move to finish,\n"
+         "\t    prints 0 once idle or 1 if still busy after ms\n"
+         "\t -u ms print a json status line every ms, or on every change with 0, until interrupted,\n"
+         "\t    and an arrived line each time a tour or scan reaches a point\n"
+         "\t -n with -d or -g, fail instead of moving after the daemon is done homing\n"
+         "\t -P preset save the position as a preset, given by ID, NAME or ID:NAME,\n"
+         "\t    at -x and -y if given, otherwise where the motor is\n"
+         "\t -g preset go to a preset, takes -s and -w like -d\n"
+         "\t -D preset delete a preset\n"
+         "\t -L list presets as id x,y name\n"
+         "\t -t tour run through the points of a tour once, points are separated by ';'\n"
+         "\t    or spaces and written X,Y or PRESET, each optionally followed by @SPEED\n"
+         "\t    and /DWELL in ms, for example \"door/5000;100,200@300/2000\"\n"
+         "\t -T tour the same, starting over after the last point\n"
+         "\t -R XSTEP[,YSTEP][/DWELL] scan a grid of points XSTEP and YSTEP apart in serpentine\n"
+         "\t    order, staying DWELL ms at each, takes -s\n"
+         "\t -B X0,Y0,X1,Y1 with -R, scan this box instead of the whole travel range\n"
+         "\t -t pause|resume|stop|info control the running tour or scan, moves also pause it\n"
+         "\t -c session mode, read one set of the options above per line from stdin\n"
+         "\t    and send them all over a single connection\n",
+         progname);
+}
 
-  initialize_request_message(&request_message);
+// status queries the shared status page can answer
+bool is_status_query(struct request *req)
+{
+  switch (req->command) {
+  case 'j':
+  case 'e':
+  case 'i':
+  case 'p':
+  case 'S':
+  case 'b':
+    return true;
+  default:
+    return false;
+  }
+}
 
-  //openlog ("motors app", LOG_PID, LOG_USER);
-  daemon_pid_file = "/var/run/motors-daemon";
-  if (check_daemon(daemon_pid_file) == 0) {
-        printf("Motors daemon is NOT running, please start the daemon\n");
-        exit(EXIT_FAILURE);
-    }
-  //should open socket here
-  struct sockaddr_un addr;
+// frame a request and send it, returns its id or 0 if the connection is gone
+uint32_t send_request(struct motor_client *mc, struct request *req, struct request_extra *extra)
+{
+  const void *data = NULL;
+  size_t data_len = 0;
+  uint32_t id;
+
+  if (req->command == 'P') {
+    data = &extra->preset;
+    data_len = sizeof(struct motor_preset);
+  } else if (req->command == 'T' && req->type == 's') {
+    data = extra->waypoints;
+    data_len = extra->nwaypoints * sizeof(struct motor_waypoint);
+  } else if (req->command == 'T' && req->type == 'g') {
+    data = &extra->scan;
+    data_len = sizeof(struct motor_scan);
+  }
+  id = motor_client_queue(mc, req, extra->flags, data, data_len);
+  if (id == 0 || motor_client_flush(mc) != 0)
+    return 0;
+  return id;
+}
 
-  int serverfd = socket(AF_UNIX, SOCK_STREAM, 0);
+/*
+ * Read the next reply or event frame. The payload is copied into reply as far
+ * as it fits, anything the daemon sends beyond that is skipped. Returns -1
+ * when the connection is gone or does not speak the protocol.
+ */
+int read_reply(struct motor_client *mc, struct motor_frame *hdr, union reply *reply)
+{
+  return motor_client_next(mc, hdr, reply, sizeof(union reply)) == 1 ? 0 : -1;
+}
 
-  if (serverfd == -1) {
-      exit(EXIT_FAILURE);
+/* "ID", "NAME" or "ID:NAME" */
+void parse_preset(const char *arg, struct motor_preset *preset)
+{
+  const char *colon = strchr(arg, ':');
+  const char *p;
+
+  memset(preset, 0, sizeof(struct motor_preset));
+  for (p = arg; *p >= '0' && *p <= '9'; p++)
+    ;
+  if (p != arg && (*p == '\0' || p == colon)) {
+    preset->id = atoi(arg);
+    arg = colon ? colon + 1 : p;
   }
-  memset(&addr, 0, sizeof(struct sockaddr_un));
-  addr.sun_family = AF_UNIX;
-  strncpy(addr.sun_path, SV_SOCK_PATH, sizeof(addr.sun_path) - 1);
+  strncpy(preset->name, arg, MOTOR_PRESET_NAME - 1);
+}
 
-  //connect to the socket
-  if (connect(serverfd, (struct sockaddr *) &addr,sizeof(struct sockaddr_un)) == -1)
-      exit(EXIT_FAILURE);
-  
-  while ((c = getopt(argc, argv, "d:s:x:y:jipSrvbI:")) != -1)
+/*
+ * "TARGET[@SPEED][/DWELL];..." where TARGET is X,Y or a preset. Returns the
+ * number of points, -1 if the tour cannot be parsed.
+ */
+int parse_tour(const char *arg, struct motor_waypoint *points)
+{
+  char *buf = strdup(arg);
+  char *save, *tok;
+  int n = 0;
+
+  if (buf == NULL)
+    return -1;
+  for (tok = strtok_r(buf, "; \t", &save); tok != NULL; tok = strtok_r(NULL, "; \t", &save)) {
+    struct motor_waypoint *wp = &points[n];
+    char *dwell = strchr(tok, '/');
+    char *speed = strchr(tok, '@');
+
+    if (n == MOTOR_MAX_WAYPOINTS) {
+      printf("A tour has at most %d points\n", MOTOR_MAX_WAYPOINTS);
+      free(buf);
+      return -1;
+    }
+    memset(wp, 0, sizeof(struct motor_waypoint));
+    if (dwell != NULL) {
+      *dwell = '\0';
+      wp->dwell_ms = atoi(dwell + 1);
+    }
+    if (speed != NULL) {
+      *speed = '\0';
+      wp->speed = atoi(speed + 1);
+    }
+    if (strchr(tok, ',') != NULL) {
+      if (sscanf(tok, "%d,%d", &wp->at.x, &wp->at.y) != 2) {
+        printf("Invalid tour point %s\n", tok);
+        free(buf);
+        return -1;
+      }
+    } else {
+      parse_preset(tok, &wp->at);
+    }
+    n++;
+  }
+  free(buf);
+  if (n == 0)
+    printf("Empty tour\n");
+  return n ? n : -1;
+}
+
+/*
+ * Turn one set of command line options into a request. Query options end the
+ * parsing as soon as they are seen, the same way the tool always behaved.
+ * Returns 0 on success, -1 on invalid arguments.
+ */
+int parse_request(int argc, char *argv[], struct request *request_message, struct request_extra *extra, bool *verbose, bool *session)
+{
+  char direction = '\0';
+  int stepspeed = 900;
+  int c;
+
+  char preset_type = '\0';
+
+  initialize_request_message(request_message);
+  memset(extra, 0, sizeof(struct request_extra));
+
+  // force getopt to reinitialise, we may parse more than one argv per process
+  optind = 0;
+  while ((c = getopt(argc, argv, "d:s:x:y:jeipSrvbI:cCmMw:u:nP:g:D:Lt:T:R:B:XY:F:")) != -1)
   {
     switch (c)
     {
     case 'd':
-      request_message.command = 'd';
+      request_message->command = 'd';
       direction = optarg[0];
       break;
     case 's':
       stepspeed = atoi(optarg);
-      request_message.speed = stepspeed;
-      request_message.speed_supplied = true; // Set speed_supplied to true when speed is provided
-      request_message.command = 's';
+      request_message->speed = stepspeed;
+      request_message->command = 's';
       break;
     case 'x':
-      request_message.x = atoi(optarg);
-      request_message.got_x = 1;
+      request_message->x = atoi(optarg);
+      request_message->got_x = 1;
       break;
     case 'y':
-      request_message.y = atoi(optarg);
-      request_message.got_y = 1;
+      request_message->y = atoi(optarg);
+      request_message->got_y = 1;
       break;
-    case 'j':
-      request_message.command = 'j';
-      if (verbose) print_request_message(&request_message);
-      write(serverfd,&request_message,sizeof(struct request));
-
-      struct motor_message status;
-      read(serverfd,&status,sizeof(struct motor_message));
-
-      JSON_status(&status);
+    case 'j': // json status
+    case 'e': // json status with the estimate
+    case 'i': // get all initial values
+    case 'p': // x,y position
+    case 'r': // reset
+    case 'S': // status
+    case 'b': // is moving?
+    case 'C': // status cache counters
+      request_message->command = c;
+      return 0;
+    case 'm': // metrics as a table
+    case 'M': // metrics as json, the type only tells print_reply which
+      request_message->command = 'M';
+      request_message->type = c == 'M' ? 'j' : 't';
       return 0;
-    case 'i':
-      // get all initial values
-      request_message.command = 'i';
-      if (verbose) print_request_message(&request_message);
-      write(serverfd,&request_message,sizeof(struct request));
-      
-      struct motor_message initial;
-      read(serverfd,&initial,sizeof(struct motor_message));
-
-      JSON_initial(&initial);
+    case 'X': // dump the daemon's trace and decode it
+      request_message->command = 'X';
+      request_message->type = 'd';
       return 0;
-    case 'p':
-      request_message.command = 'p';
-      if (verbose) print_request_message(&request_message);
-      write(serverfd,&request_message,sizeof(struct request));
-      
-      struct motor_message pos;
-      read(serverfd,&pos,sizeof(struct motor_message));
-
-      xy_pos(&pos);
+    case 'Y': // decode a trace dump, no daemon needed
+      request_message->command = 'Y';
+      extra->trace_file = optarg;
       return 0;
+    case 'F': // trace categories
+    {
+      long mask = motor_trace_parse_mask(optarg);
+      if (mask < 0) {
+        printf("Invalid trace categories %s\n", optarg);
+        return -1;
+      }
+      request_message->command = 'X';
+      request_message->type = 'f';
+      request_message->x = mask;
+      request_message->got_x = 1;
+      return 0;
+    }
     case 'v':
-      verbose = true; // Enable verbose mode
+      *verbose = true; // Enable verbose mode
       break;
-    case 'r': // reset
-      request_message.command = 'r';
-      if (verbose) print_request_message(&request_message);
-      write(serverfd,&request_message,sizeof(struct request));
+    case 'c':
+      *session = true;
+      break;
+    case 'n':
+      extra->flags |= MOTOR_FLAG_NO_QUEUE;
+      break;
+    case 'P': // save preset
+    case 'g': // go to preset
+    case 'D': // delete preset
+      parse_preset(optarg, &extra->preset);
+      preset_type = c == 'P' ? 's' : (c == 'g' ? 'g' : 'd');
+      break;
+    case 't': // tour once, or control the running one
+    case 'T': // looping tour
+      request_message->command = 'T';
+      if (c == 't' && strcmp(optarg, "pause") == 0)
+        request_message->type = 'p';
+      else if (c == 't' && strcmp(optarg, "resume") == 0)
+        request_message->type = 'r';
+      else if (c == 't' && strcmp(optarg, "stop") == 0)
+        request_message->type = 'q';
+      else if (c == 't' && strcmp(optarg, "info") == 0)
+        request_message->type = 'i';
+      else {
+        request_message->type = 's';
+        request_message->x = c == 'T';
+        extra->nwaypoints = parse_tour(optarg, extra->waypoints);
+        if (extra->nwaypoints < 0)
+          return -1;
+      }
       return 0;
-    case 'S': // status
-      request_message.command = 'S';
-      if (verbose) print_request_message(&request_message);
-      write(serverfd,&request_message,sizeof(struct request));
-      
-      struct motor_message stat;
-      read(serverfd,&stat,sizeof(struct motor_message));
-
-      show_status(&stat);
+    case 'R': // grid scan, "XSTEP[,YSTEP][/DWELL]"
+    {
+      char *dwell = strchr(optarg, '/');
+      int n = sscanf(optarg, "%d,%d", &extra->scan.x_step, &extra->scan.y_step);
+      if (n < 1 || extra->scan.x_step <= 0) {
+        printf("Invalid scan step %s\n", optarg);
+        return -1;
+      }
+      if (n == 1)
+        extra->scan.y_step = extra->scan.x_step;
+      if (dwell != NULL)
+        extra->scan.dwell_ms = atoi(dwell + 1);
+      break;
+    }
+    case 'B': // scan box
+      if (sscanf(optarg, "%d,%d,%d,%d", &extra->scan.x_min, &extra->scan.y_min,
+                 &extra->scan.x_max, &extra->scan.y_max) != 4) {
+        printf("Invalid scan box %s\n", optarg);
+        return -1;
+      }
+      extra->scan.flags |= MOTOR_SCAN_BOX;
+      break;
+    case 'L': // list presets
+      request_message->command = 'P';
+      request_message->type = 'l';
+      return 0;
+    case 'w':
+      request_message->wait = atoi(optarg);
+      break;
+    case 'u': // subscribe, x carries the period in ms
+      request_message->command = 'u';
+      request_message->x = atoi(optarg);
       return 0;
     case 'I': // Invert motor
-      request_message.command = 'I';
+      request_message->command = 'I';
       if (optarg) {
           if (strcmp(optarg, "x") == 0) {
-              request_message.type = 'x'; // Invert X
+              request_message->type = 'x'; // Invert X
           } else if (strcmp(optarg, "y") == 0) {
-              request_message.type = 'y'; // Invert Y
+              request_message->type = 'y'; // Invert Y
           } else if (strcmp(optarg, "b") == 0) {
-              request_message.type = 'b'; // Invert both
+              request_message->type = 'b'; // Invert both
           } else {
               printf("Invalid option for -I: %s\n", optarg);
-              exit(EXIT_FAILURE);
+              return -1;
           }
       } else {
-          request_message.type = 'b'; // Default to inverting both axes
+          request_message->type = 'b'; // Default to inverting both axes
       }
-
-      if (verbose) print_request_message(&request_message);
-      write(serverfd,&request_message,sizeof(struct request));
       return 0;
-    case 'b': // is moving?
-      request_message.command = 'b';
-      if (verbose) print_request_message(&request_message);
-      write(serverfd,&request_message,sizeof(struct request));
-      
-      struct motor_message busy;
-      read(serverfd,&busy,sizeof(struct motor_message));
-        if(busy.status == MOTOR_IS_RUNNING){
-          printf("1\n");
-          return(1);
-        }
-        else{
-          printf("0\n");
-          return(0);
-        }
     default:
       printf("Invalid Argument %c\n", c);
-      printf("Usage : %s\n"
-             "\t -d Direction step\n"
-             "\t -s Speed step (default 900)\n"
-             "\t -x X position/step (default 0)\n"
-             "\t -y Y position/step (default 0) .\n"
-             "\t -r reset to default pos.\n"
-             "\t -v verbose mode, prints debugging information while app is running\n"
-             "\t -j return json string xpos,ypos,status.\n"
-             "\t -i return json string for all camera parameters\n"
-             "\t -p return xpos,ypos as a string\n"
-             "\t -b prints 1 if motor is (b)usy moving or 0 if is not\n"
-             "\t -S show status\n"
-             "\t -I Invert motor direction with 'x', 'y', or 'b' for both axes\n",
-             argv[0]);
-      exit(EXIT_FAILURE);
+      usage(argv[0]);
+      return -1;
     }
   }
 
-  // If the command is speed only, send it and return
-  if (request_message.command == 's') {
-    if (verbose) print_request_message(&request_message);
-    write(serverfd,&request_message,sizeof(struct request));
+  // preset commands take -x, -y, -s and -w along
+  if (preset_type != '\0') {
+    request_message->command = 'P';
+    request_message->type = preset_type;
     return 0;
   }
 
-  // Ensure the final request uses the correct speed if supplied
-  if (request_message.speed_supplied) {
-    request_message.speed = stepspeed;
-  } else {
-    request_message.speed = 0;  // Indicate that speed is not set
+  // a scan takes -B and -s along
+  if (extra->scan.x_step != 0) {
+    request_message->command = 'T';
+    request_message->type = 'g';
+    return 0;
   }
 
-  if (request_message.command == 'd') {
+  // If the command is speed only, it is complete as is
+  if (request_message->command == 's')
+    return 0;
+
+  // -w on its own waits for the motor to be idle
+  if (request_message->command == 'd' && direction == '\0' && request_message->wait > 0) {
+    request_message->command = 'w';
+    return 0;
+  }
+
+  if (request_message->command == 'd') {
     switch (direction)
     {
     case 's': // stop
-      request_message.type = 's';
-      break;
-
     case 'c': // cruise
-      request_message.type = 'c';
-      break;
-
     case 'b': // go back
-      request_message.type = 'b';
-      break;
-
     case 'h': // set position (absolute movement)
-      request_message.type = 'h';
-      break;
-
     case 'g': // move x y (relative movement)
-      request_message.type = 'g';
+    case 'v': // keep moving at x y steps/s (velocity)
+    case 'k': // follow a stream of x y targets (tracking)
+      request_message->type = direction;
       break;
 
     default:
+      if (*session && direction == '\0') {
+        request_message->command = '\0'; // nothing to send, options only
+        return 0;
+      }
       printf("Invalid Direction Argument %c\n", direction);
       printf("Usage : %s -d\n"
              "\t s (Stop)\n"
              "\t c (Cruise)\n"
              "\t b (Go to home position)\n"
              "\t h (Set position X and Y)\n"
-             "\t g (Steps X and Y)\n",
+             "\t g (Steps X and Y)\n"
+             "\t v (Keep moving at X and Y steps/s, repeat within the daemon deadman timeout, 0 0 stops)\n"
+             "\t k (Track target X and Y, send one per detection, the daemon filters them)\n",
              argv[0]);
-      exit(EXIT_FAILURE);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Latency below which a share of the histogram's samples fall, as the upper
+ * end of the bucket that share ends in, capped at the largest time seen.
+ */
+uint32_t histogram_percentile(const struct motor_histogram *h, double share)
+{
+  uint64_t want = (uint64_t) (h->count * share + 0.5), seen = 0;
+  uint32_t upper = 0;
+  int b;
+
+  if (want == 0)
+    want = 1;
+  for (b = 0; b < MOTOR_HIST_BUCKETS; b++) {
+    seen += h->bucket[b];
+    upper = b == MOTOR_HIST_BUCKETS - 1 ? h->max_us : 1u << b;
+    if (seen >= want)
+      break;
+  }
+  return upper < h->max_us ? upper : h->max_us;
+}
+
+void show_histogram(const char *name, const struct motor_histogram *h)
+{
+  if (h->count == 0)
+    return;
+  printf("%-12s %8u %8llu %8u %8u %8u\n", name, h->count,
+         (unsigned long long) (h->sum_us / h->count),
+         histogram_percentile(h, 0.5), histogram_percentile(h, 0.99), h->max_us);
+}
+
+void JSON_histogram(const char *name, const struct motor_histogram *h)
+{
+  int b;
+
+  printf("\"%s\":{\"count\":%u,\"sum_us\":%llu,\"max_us\":%u,\"buckets\":[",
+         name, h->count, (unsigned long long) h->sum_us, h->max_us);
+  for (b = 0; b < MOTOR_HIST_BUCKETS; b++)
+    printf("%s%u", b ? "," : "", h->bucket[b]);
+  printf("]}");
+}
+
+const char *const ioctl_names[MOTOR_METRICS_IOCTLS] = {
+  "STOP", "RESET", "MOVE", "GET_STATUS", "SPEED", "GOBACK", "CRUISE"
+};
+
+void show_metrics(struct motor_metrics *m, struct motor_command_metrics *commands, uint32_t ncommands, bool json)
+{
+  char name[16];
+  uint32_t i;
+
+  if (json) {
+    printf("{\"uptime_ms\":%u,\"connections\":%u,\"connections_peak\":%u,\"accepted\":%u,"
+           "\"queue_depth\":%u,\"queue_peak\":%u,\"commands\":{",
+           m->uptime_ms, m->connections, m->connections_peak, m->accepted, m->queue_depth, m->queue_peak);
+    for (i = 0; i < ncommands; i++) {
+      snprintf(name, sizeof(name), "%c", commands[i].command);
+      printf("%s", i ? "," : "");
+      JSON_histogram(name, &commands[i].time);
+    }
+    printf("},\"socket\":{");
+    JSON_histogram("read", &m->socket_read);
+    printf(",");
+    JSON_histogram("write", &m->socket_write);
+    printf("},\"ioctl\":{");
+    for (i = 0; i < MOTOR_METRICS_IOCTLS; i++) {
+      printf("%s", i ? "," : "");
+      JSON_histogram(ioctl_names[i], &m->ioctl[i]);
+    }
+    printf("}}\n");
+    return;
+  }
+
+  printf("Up %u ms, %u connections open, %u at most, %u accepted.\n",
+         m->uptime_ms, m->connections, m->connections_peak, m->accepted);
+  printf("Command queue %u deep, %u at most.\n", m->queue_depth, m->queue_peak);
+  printf("%-12s %8s %8s %8s %8s %8s\n", "us", "count", "mean", "p50", "p99", "max");
+  for (i = 0; i < ncommands; i++) {
+    snprintf(name, sizeof(name), "request %c", commands[i].command);
+    show_histogram(name, &commands[i].time);
+  }
+  show_histogram("socket read", &m->socket_read);
+  show_histogram("socket write", &m->socket_write);
+  for (i = 0; i < MOTOR_METRICS_IOCTLS; i++)
+    show_histogram(ioctl_names[i], &m->ioctl[i]);
+}
+
+/* decode a dump written by the daemon, oldest record first */
+int show_trace(const char *path)
+{
+  struct motor_trace_header hdr;
+  struct motor_trace_record *ring;
+  char line[128];
+  uint32_t i, first;
+  FILE *f = fopen(path, "rb");
+
+  if (f == NULL) {
+    printf("Could not open %s\n", path);
+    return 1;
+  }
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != MOTOR_TRACE_MAGIC ||
+      hdr.version != MOTOR_TRACE_VERSION || hdr.record_size != sizeof(struct motor_trace_record) ||
+      hdr.records == 0) {
+    printf("%s is not a trace dump\n", path);
+    fclose(f);
+    return 1;
+  }
+  ring = calloc(hdr.records, sizeof(struct motor_trace_record));
+  if (ring == NULL || fread(ring, sizeof(struct motor_trace_record), hdr.records, f) != hdr.records) {
+    printf("%s is cut short\n", path);
+    free(ring);
+    fclose(f);
+    return 1;
+  }
+  fclose(f);
+
+  printf("Trace of pid %d, %u records written", hdr.pid, hdr.written);
+  if (hdr.signal != 0)
+    printf(", dumped on signal %d (%s)", hdr.signal, strsignal(hdr.signal));
+  printf(".\n");
+  first = hdr.written > hdr.records ? hdr.written - hdr.records : 0;
+  for (i = first; i != hdr.written; i++) {
+    struct motor_trace_record *r = &ring[i % hdr.records];
+    uint64_t us;
+    // overwritten since, or still being written at the time of the dump
+    if (atomic_load_explicit(&r->seq, memory_order_relaxed) != i + 1)
+      continue;
+    us = r->stamp_us - hdr.started_us;
+    motor_trace_format(r, line, sizeof(line));
+    printf("%6llu.%06llu %s\n", (unsigned long long) (us / 1000000), (unsigned long long) (us % 1000000), line);
+  }
+  free(ring);
+  return 0;
+}
+
+// prints the reply to a command, returns the exit status for it
+int print_reply(struct request *req, struct motor_frame *hdr, union reply *reply)
+{
+  struct motor_message *msg = &reply->msg;
+
+  // a wait that ran out still carries the status, reported as busy below
+  if (hdr->status != MOTOR_OK && hdr->status != MOTOR_ERR_TIMEOUT) {
+    printf("Error: %s\n", motor_strerror(hdr->status));
+    return 1;
+  }
+
+  switch (req->command) {
+  case 'j':
+    JSON_status(msg);
+    break;
+  case 'e':
+    JSON_estimate(&reply->status);
+    break;
+  case 'i':
+    JSON_initial(msg);
+    break;
+  case 'p':
+    xy_pos(msg);
+    break;
+  case 'S':
+    show_status(msg);
+    break;
+  case 'd': // move, with -w once it is done
+    if (req->wait <= 0)
+      break;
+    /* fall through */
+  case 'b':
+  case 'w': // wait until idle
+    if (msg->status != MOTOR_IS_STOP) {
+      printf("1\n");
+      return 1;
     }
+    printf("0\n");
+    break;
+  case 'P':
+    if (req->type == 'l') {
+      size_t i;
+      for (i = 0; i < hdr->length / sizeof(struct motor_preset) && i < MOTOR_MAX_PRESETS; i++)
+        printf("%d %d,%d %s\n", reply->presets[i].id, reply->presets[i].x, reply->presets[i].y, reply->presets[i].name);
+    } else if (req->type == 'g' && req->wait > 0) {
+      printf("%d\n", msg->status != MOTOR_IS_STOP);
+      return msg->status != MOTOR_IS_STOP;
+    }
+    break;
+  case 'T': {
+    static const char *const states[] = { "idle", "moving to", "at", "paused at" };
+    struct motor_route_status *rs = &reply->route;
+    const char *what = rs->kind == 'g' ? "Scan" : "Tour";
+    if (rs->state == MOTOR_ROUTE_IDLE || rs->state > MOTOR_ROUTE_PAUSED)
+      printf("%s idle.\n", what);
+    else
+      printf("%s %s point %d of %d%s.\n", what, states[rs->state], rs->pos + 1, rs->len, rs->loop ? ", looping" : "");
+    break;
+  }
+  case 'C':
+    printf("Status ioctls %u, served from cache %u.\n", reply->counters.ioctls, reply->counters.hits);
+    printf("Move requests %u, merged %u.\n", reply->counters.moves, reply->counters.merged);
+    printf("Tracking targets %u, moved for %u.\n", reply->counters.targets, reply->counters.target_moves);
+    printf("Ready after %u ms, ", reply->counters.ready_ms);
+    if (reply->counters.homed_ms != 0)
+      printf("homed after %u ms.\n", reply->counters.homed_ms);
+    else
+      printf("still homing.\n");
+    break;
+  case 'M': {
+    uint32_t n = reply->metrics.m.ncommands;
+    if (n > MOTOR_METRICS_MAX_COMMANDS)
+      n = MOTOR_METRICS_MAX_COMMANDS;
+    show_metrics(&reply->metrics.m, reply->metrics.commands, n, req->type == 'j');
+    break;
+  }
+  case 'X': {
+    int i;
+    if (req->type == 'd')
+      return show_trace(reply->trace.path);
+    printf("Tracing");
+    for (i = 0; i < MOTOR_TRACE_CATEGORIES; i++)
+      if (reply->trace.mask & (1u << i))
+        printf(" %s", motor_trace_categories[i]);
+    printf(reply->trace.mask ? ".\n" : " nothing.\n");
+    break;
   }
+  }
+  return 0;
+}
 
-  // Print and send the final request message if it's a move command
-  if (request_message.command == 'd') {
-    if (verbose) print_request_message(&request_message);
-    write(serverfd,&request_message,sizeof(struct request));
+/*
+ * Session mode: every line of stdin is a set of options, sent over the one
+ * connection. Requests are written back to back and their replies are only
+ * collected once no more input is immediately pending, so a piped batch is
+ * pipelined while an interactive session still answers line by line.
+ */
+#define SESSION_MAX_ARGS 16
+#define SESSION_WINDOW 8
+#define SESSION_LINE_SIZE 256
+
+char session_buf[SESSION_LINE_SIZE * 4];
+size_t session_len = 0;
+
+// returns 1 with a line, 0 on end of input
+int session_getline(char *line, size_t size)
+{
+  for (;;) {
+    char *nl = memchr(session_buf, '\n', session_len);
+    if (nl != NULL || session_len == sizeof(session_buf)) {
+      size_t len = nl ? (size_t)(nl - session_buf) + 1 : session_len;
+      size_t copy = len < size ? len : size - 1;
+      memcpy(line, session_buf, copy);
+      line[copy] = '\0';
+      session_len -= len;
+      memmove(session_buf, session_buf + len, session_len);
+      return 1;
+    }
+    ssize_t n = read(STDIN_FILENO, session_buf + session_len, sizeof(session_buf) - session_len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (session_len == 0)
+        return 0;
+      memcpy(line, session_buf, session_len < size ? session_len : size - 1);
+      line[session_len < size ? session_len : size - 1] = '\0';
+      session_len = 0;
+      return 1;
+    }
+    session_len += n;
   }
+}
+
+bool session_input_pending()
+{
+  struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+  if (memchr(session_buf, '\n', session_len) != NULL)
+    return true;
+  return poll(&pfd, 1, 0) > 0;
+}
+
+/* requests sent in a session whose replies have not been read yet */
+struct session_pending
+{
+  uint32_t id;
+  struct request req;
+};
 
+int run_session(struct motor_client *mc, bool verbose)
+{
+  char line[SESSION_LINE_SIZE];
+  struct session_pending pending[SESSION_WINDOW];
+  int npending = 0;
+  int i;
+
+  for (;;) {
+    bool more = session_getline(line, sizeof(line)) == 1;
+
+    if (more) {
+      char *args[SESSION_MAX_ARGS + 1];
+      int nargs = 0;
+      bool session = true;
+      struct request req;
+      struct request_extra extra;
+      char *tok = strtok(line, " \t\r\n");
+
+      args[nargs++] = "session";
+      while (tok != NULL && nargs < SESSION_MAX_ARGS) {
+        args[nargs++] = tok;
+        tok = strtok(NULL, " \t\r\n");
+      }
+      args[nargs] = NULL;
+
+      if (nargs > 1 && parse_request(nargs, args, &req, &extra, &verbose, &session) == 0 && req.command != '\0') {
+        if (verbose) print_request_message(&req);
+        pending[npending].id = send_request(mc, &req, &extra);
+        if (pending[npending].id == 0) {
+          printf("Connection to the daemon lost\n");
+          return EXIT_FAILURE;
+        }
+        pending[npending++].req = req;
+      }
+    }
+
+    // collect replies once the window is full or input has dried up
+    while (npending == SESSION_WINDOW || (npending > 0 && (!more || !session_input_pending()))) {
+      struct motor_frame hdr;
+      union reply reply;
+      if (read_reply(mc, &hdr, &reply) == -1) {
+        printf("Connection to the daemon lost\n");
+        return EXIT_FAILURE;
+      }
+      if (hdr.kind == MOTOR_FRAME_EVENT) {
+        JSON_event(&hdr, &reply);
+        continue;
+      }
+      for (i = 0; i < npending && pending[i].id != hdr.id; i++)
+        ;
+      if (i == npending)
+        continue;
+      print_reply(&pending[i].req, &hdr, &reply);
+      pending[i] = pending[--npending];
+      fflush(stdout);
+    }
+
+    if (!more)
+      return 0;
+  }
+}
+
+/*
+ * Status queries are answered from the daemon's shared status page when it
+ * holds a current snapshot, without a socket round trip. Returns -1 when the
+ * caller has to ask the daemon instead.
+ */
+int status_from_shm(struct request *req, struct motor_status_reply *reply)
+{
+  struct motor_shm_status st;
+  struct motor_motion motion;
+  const struct motor_shm *shm;
+  struct timespec ts;
+  int64_t now;
+  int ret;
+
+  if (!is_status_query(req))
+    return -1;
+
+  shm = motor_shm_open(MOTOR_SHM_PATH);
+  if (shm == NULL)
+    return -1;
+  // the page stays behind when the daemon goes, it is only current while its publisher runs
+  if (kill(shm->pid, 0) == -1 && errno == ESRCH) {
+    motor_shm_close(shm);
+    return -1;
+  }
+  ret = motor_shm_snapshot(shm, &st, NULL, &motion);
+  motor_shm_close(shm);
+  if (ret != 0)
+    return -1;
+
+  memcpy(&reply->msg, &st, sizeof(struct motor_message));
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  motor_motion_estimate(&motion, now, &reply->estimate.x, &reply->estimate.y);
+  reply->estimate.age_ms = now - motion.stamp_ms;
   return 0;
 }
+
+int main(int argc, char *argv[])
+{
+  struct motor_client client;
+  struct request request_message;
+  struct request_extra extra;
+  bool verbose = false; // Initialize verbose to false
+  bool session = false;
+
+  //openlog ("motors app", LOG_PID, LOG_USER);
+  if (parse_request(argc, argv, &request_message, &extra, &verbose, &session) != 0)
+    exit(EXIT_FAILURE);
+
+  // a dump outlives the daemon that wrote it
+  if (request_message.command == 'Y')
+    return show_trace(extra.trace_file);
+
+  if (!session) {
+    union reply reply;
+    struct motor_frame hdr = { .status = MOTOR_OK };
+    if (status_from_shm(&request_message, &reply.status) == 0) {
+      if (verbose) printf("Read status from %s\n", MOTOR_SHM_PATH);
+      return print_reply(&request_message, &hdr, &reply);
+    }
+  }
+
+  // a daemon that is not running does not accept either, no need to look for its pid first
+  if (motor_client_open(&client, 0) == -1) {
+    printf("Motors daemon is NOT running, please start the daemon\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (session)
+    return run_session(&client, verbose);
+
+  if (verbose) print_request_message(&request_message);
+  uint32_t id = send_request(&client, &request_message, &extra);
+  if (id == 0)
+    exit(EXIT_FAILURE);
+
+  for (;;) {
+    struct motor_frame hdr;
+    union reply reply;
+    if (read_reply(&client, &hdr, &reply) == -1)
+      exit(EXIT_FAILURE);
+    if (hdr.id != id)
+      continue;
+    if (hdr.kind == MOTOR_FRAME_EVENT) {
+      JSON_event(&hdr, &reply);
+      fflush(stdout);
+      continue;
+    }
+    // a subscription keeps streaming events once it is accepted
+    if (request_message.command == 'u' && hdr.status == MOTOR_OK)
+      continue;
+    return print_reply(&request_message, &hdr, &reply);
+  }
+}